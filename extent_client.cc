@@ -9,9 +9,7 @@
 
 extent_client::extent_client(std::string dst)
 {
-  sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
+  cl = new rpcc(dst);
   if (cl->bind() != 0) {
     printf("extent_client: bind failed\n");
   }
@@ -24,7 +22,7 @@ extent_client::getattr(extent_protocol::extentid_t eid,
 		       extent_protocol::attr &attr)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::getattr, eid, attr);
+  ret = cl->call<extent_protocol::getattr>(eid, attr);
   return ret;
 }
 
@@ -32,7 +30,7 @@ extent_protocol::status
 extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::create, type, id);
+  ret = cl->call<extent_protocol::create>(type, id);
   return ret;
 }
 
@@ -40,16 +38,16 @@ extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::get, eid, buf);
+  ret = cl->call<extent_protocol::get>(eid, buf);
   return ret;
 }
 
 extent_protocol::status
-extent_client::put(extent_protocol::extentid_t eid, std::string buf)
+extent_client::put(extent_protocol::extentid_t eid, const std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
   int r;
-  ret = cl->call(extent_protocol::put, eid, buf, r);
+  ret = cl->call<extent_protocol::put>(eid, buf, r);
   return ret;
 }
 
@@ -58,6 +56,6 @@ extent_client::remove(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret = extent_protocol::OK;
   int r;
-  ret = cl->call(extent_protocol::remove, eid, r);
+  ret = cl->call<extent_protocol::remove>(eid, r);
   return ret;
 }
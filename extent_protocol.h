@@ -32,6 +32,13 @@ class extent_protocol {
   };
 };
 
+RPC_PROC(extent_protocol::put, int, extent_protocol::extentid_t, std::string);
+RPC_PROC(extent_protocol::get, std::string, extent_protocol::extentid_t);
+RPC_PROC(extent_protocol::getattr, extent_protocol::attr,
+         extent_protocol::extentid_t);
+RPC_PROC(extent_protocol::remove, int, extent_protocol::extentid_t);
+RPC_PROC(extent_protocol::create, extent_protocol::extentid_t, uint32_t);
+
 inline unmarshall &
 operator>>(unmarshall &u, extent_protocol::attr &a)
 {
@@ -43,6 +50,12 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   return u;
 }
 
+inline int
+wire_size(const extent_protocol::attr &)
+{
+  return 5 * 4;
+}
+
 inline marshall &
 operator<<(marshall &m, extent_protocol::attr a)
 {
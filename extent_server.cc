@@ -23,13 +23,12 @@ int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+// buf points into the request; write_file copies it into the blocks
+int extent_server::put(extent_protocol::extentid_t id, rpc_view buf, int &)
 {
   id &= 0x7fffffff;
   
-  const char * cbuf = buf.c_str();
-  int size = buf.size();
-  im->write_file(id, cbuf, size);
+  im->write_file(id, buf.data, buf.size);
   
   return extent_protocol::OK;
 }
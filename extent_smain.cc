@@ -26,11 +26,14 @@ main(int argc, char *argv[])
   rpcs server(atoi(argv[1]), count);
   extent_server ls;
 
-  server.reg(extent_protocol::get, &ls, &extent_server::get);
-  server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
-  server.reg(extent_protocol::put, &ls, &extent_server::put);
-  server.reg(extent_protocol::remove, &ls, &extent_server::remove);
-  server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg<extent_protocol::get>(&ls, &extent_server::get);
+  server.reg<extent_protocol::getattr>(&ls, &extent_server::getattr);
+  server.reg<extent_protocol::put>(&ls, &extent_server::put);
+  server.reg<extent_protocol::remove>(&ls, &extent_server::remove);
+  server.reg<extent_protocol::create>(&ls, &extent_server::create);
+  // reads can run again if their cached reply was evicted
+  server.set_procflags(extent_protocol::get, rpcs::PROC_IDEMPOTENT);
+  server.set_procflags(extent_protocol::getattr, rpcs::PROC_IDEMPOTENT);
 
   while(1)
     sleep(1000);
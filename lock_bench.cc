@@ -0,0 +1,82 @@
+//
+// Lock service throughput benchmark.
+//
+// Each thread has its own lock_client and acquires and releases its
+// own lock ids in a loop, so the only contention is in the lock
+// service itself. Give several [host:]port separated by commas to
+// measure a sharded service.
+//
+
+#include "lock_protocol.h"
+#include "lock_client.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "lang/verify.h"
+
+std::string dst;
+int seconds = 5;
+volatile bool done;
+
+struct worker {
+  int id;
+  unsigned long long ops;
+};
+
+void *
+bench(void *x)
+{
+  worker *w = (worker *) x;
+  lock_client lc(dst);
+
+  while (!done) {
+    // disjoint per thread, and spread over the shards
+    lock_protocol::lockid_t lid =
+      ((lock_protocol::lockid_t) w->id << 32) + (w->ops & 0xff);
+    lc.acquire(lid);
+    lc.release(lid);
+    w->ops++;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nt = 8;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  if(argc < 2 || argc > 4){
+    fprintf(stderr, "Usage: %s [host:]port[,[host:]port...] [threads] [seconds]\n",
+            argv[0]);
+    exit(1);
+  }
+  dst = argv[1];
+  if (argc > 2)
+    nt = atoi(argv[2]);
+  if (argc > 3)
+    seconds = atoi(argv[3]);
+
+  pthread_t th[nt];
+  worker w[nt];
+  for (int i = 0; i < nt; i++) {
+    w[i].id = i + 1;
+    w[i].ops = 0;
+    VERIFY(pthread_create(&th[i], NULL, bench, (void *) &w[i]) == 0);
+  }
+  sleep(seconds);
+  done = true;
+
+  unsigned long long total = 0;
+  for (int i = 0; i < nt; i++) {
+    VERIFY(pthread_join(th[i], NULL) == 0);
+    total += w[i].ops;
+  }
+  printf("%d threads, %s: %llu acquire/release pairs in %d s, %.0f pairs/s\n",
+         nt, dst.c_str(), total, seconds, (double) total / seconds);
+  return 0;
+}
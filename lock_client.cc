@@ -2,39 +2,204 @@
 
 #include "lock_client.h"
 #include "rpc.h"
+#include "method_thread.h"
+#include "slock.h"
+#include "gettime.h"
 #include <arpa/inet.h>
+#include <time.h>
 
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include <stdio.h>
 
+// points each shard gets on the hash ring; more points even out the
+// share of the id space each shard owns.
+#define RING_POINTS 64
+
+static unsigned int
+fnv1a(const std::string &s)
+{
+  unsigned int h = 2166136261U;
+  for (unsigned int i = 0; i < s.size(); i++) {
+    h ^= (unsigned char) s[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static unsigned int
+hash_lid(lock_protocol::lockid_t lid)
+{
+  // 64-bit finalizer from MurmurHash3, so that neighbouring
+  // inums land on unrelated ring points
+  lid ^= lid >> 33;
+  lid *= 0xff51afd7ed558ccdULL;
+  lid ^= lid >> 33;
+  lid *= 0xc4ceb9fe1a85ec53ULL;
+  lid ^= lid >> 33;
+  return (unsigned int) lid;
+}
+
 lock_client::lock_client(std::string dst)
+  : stopping(false)
+{
+  std::istringstream ist(dst);
+  std::string one;
+  while (std::getline(ist, one, ',')) {
+    if (one.empty())
+      continue;
+    shard s;
+    if (one.compare(0, 5, "unix:") == 0) {
+      s.dst = one;
+    } else {
+      sockaddr_in dstsock;
+      make_sockaddr(one.c_str(), &dstsock);
+      std::ostringstream ost;
+      ost << inet_ntoa(dstsock.sin_addr) << ":" << ntohs(dstsock.sin_port);
+      s.dst = ost.str();
+    }
+    s.cl = new rpcc(one);
+    if (s.cl->bind() < 0) {
+      printf("lock_client: call bind\n");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s.last_sent);
+    shards.push_back(s);
+  }
+  VERIFY(shards.size() > 0);
+
+  for (unsigned int i = 0; i < shards.size(); i++) {
+    for (int p = 0; p < RING_POINTS; p++) {
+      std::ostringstream ost;
+      ost << shards[i].dst << "#" << p;
+      ring[fnv1a(ost.str())] = i;
+    }
+  }
+
+  VERIFY(pthread_mutex_init(&m, NULL) == 0);
+  // renew_loop's deadlines are on the same clock as last_sent, so a
+  // wall-clock step can neither stall nor rush the renewals
+  pthread_condattr_t ca;
+  VERIFY(pthread_condattr_init(&ca) == 0);
+  VERIFY(pthread_condattr_setclock(&ca, CLOCK_MONOTONIC) == 0);
+  VERIFY(pthread_cond_init(&renew_c, &ca) == 0);
+  VERIFY(pthread_condattr_destroy(&ca) == 0);
+  VERIFY((renewer = method_thread(this, false, &lock_client::renew_loop)) != 0);
+}
+
+lock_client::~lock_client()
 {
-  sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
-  if (cl->bind() < 0) {
-    printf("lock_client: call bind\n");
+  {
+    ScopedLock ml(&m);
+    stopping = true;
+    VERIFY(pthread_cond_signal(&renew_c) == 0);
   }
+  VERIFY(pthread_join(renewer, NULL) == 0);
+  VERIFY(pthread_mutex_destroy(&m) == 0);
+  VERIFY(pthread_cond_destroy(&renew_c) == 0);
 }
 
-int
-lock_client::stat(lock_protocol::lockid_t lid)
+// the shard owning lid: the first ring point at or after its hash
+lock_client::shard &
+lock_client::route(lock_protocol::lockid_t lid)
 {
-    int r;
-    lock_protocol::status ret = cl->call(lock_protocol::stat,
-                                         cl->id(), lid, r);
-    VERIFY (ret == lock_protocol::OK);
-    return r;
+  std::map<unsigned int, unsigned int>::iterator it =
+    ring.lower_bound(hash_lid(lid));
+  if (it == ring.end())
+    it = ring.begin();
+  return shards[it->second];
+}
+
+std::string
+lock_client::owner(lock_protocol::lockid_t lid)
+{
+  return route(lid).dst;
+}
+
+// any RPC to a server renews our lease there
+void
+lock_client::sent(shard &s)
+{
+  ScopedLock ml(&m);
+  clock_gettime(CLOCK_MONOTONIC, &s.last_sent);
+}
+
+void
+lock_client::renew_loop()
+{
+  int interval = lock_protocol::lease_ms / 3;
+
+  while (true) {
+    std::vector<shard *> due;
+    {
+      ScopedLock ml(&m);
+      struct timespec now, deadline;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      add_timespec(now, interval, &deadline);
+      while (!stopping &&
+             pthread_cond_timedwait(&renew_c, &m, &deadline) != ETIMEDOUT)
+        ;
+      if (stopping)
+        break;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      for (unsigned int i = 0; i < shards.size(); i++) {
+        if (shards[i].nheld > 0 &&
+            diff_timespec(now, shards[i].last_sent) >= interval)
+          due.push_back(&shards[i]);
+      }
+    }
+    for (unsigned int i = 0; i < due.size(); i++) {
+      int r;
+      sent(*due[i]);
+      if (due[i]->cl->call<lock_protocol::renew>(due[i]->cl->id(), r) !=
+          lock_protocol::OK)
+        printf("lock_client: renew to %s failed\n", due[i]->dst.c_str());
+    }
+  }
+}
+
+// lid 0 asks every shard and merges the answers into one
+// aggregate and one top_n list
+lock_protocol::status
+lock_client::stat(lock_protocol::lockid_t lid, lock_protocol::statinfo &r)
+{
+    lock_protocol::status ret = lock_protocol::OK;
+    if (lid != 0) {
+        shard &s = route(lid);
+        sent(s);
+        ret = s.cl->call<lock_protocol::stat>(s.cl->id(), lid, r);
+        VERIFY (ret == lock_protocol::OK);
+        return ret;
+    }
+
+    r.total = lock_protocol::lockstat();
+    r.locks.clear();
+    for (unsigned int i = 0; i < shards.size(); i++) {
+        lock_protocol::statinfo one;
+        sent(shards[i]);
+        ret = shards[i].cl->call<lock_protocol::stat>(shards[i].cl->id(),
+                                                      lid, one);
+        VERIFY (ret == lock_protocol::OK);
+        r.total.merge(one.total);
+        r.locks.insert(r.locks.end(), one.locks.begin(), one.locks.end());
+    }
+    std::sort(r.locks.begin(), r.locks.end(), lock_protocol::lockstat::hotter);
+    if (r.locks.size() > lock_protocol::top_n)
+        r.locks.resize(lock_protocol::top_n);
+    return ret;
 }
 
 lock_protocol::status
 lock_client::acquire(lock_protocol::lockid_t lid)
 {
     int r;
-    lock_protocol::status ret = cl->call(lock_protocol::acquire,
-                                         cl->id(), lid, r);
+    shard &s = route(lid);
+    sent(s);
+    lock_protocol::status ret =
+      s.cl->call<lock_protocol::acquire>(s.cl->id(), lid, r);
     VERIFY (ret == lock_protocol::OK);
+    ScopedLock ml(&m);
+    s.nheld++;
     return ret;
 }
 
@@ -42,8 +207,15 @@ lock_protocol::status
 lock_client::release(lock_protocol::lockid_t lid)
 {
     int r;
-    lock_protocol::status ret = cl->call(lock_protocol::release,
-                                         cl->id(), lid, r);
-    VERIFY (ret == lock_protocol::OK);
+    shard &s = route(lid);
+    sent(s);
+    lock_protocol::status ret =
+      s.cl->call<lock_protocol::release>(s.cl->id(), lid, r);
+    if (ret == lock_protocol::NOENT)
+        printf("lock_client: lease on %016llx had expired\n", lid);
+    else
+        VERIFY (ret == lock_protocol::OK);
+    ScopedLock ml(&m);
+    s.nheld--;
     return ret;
 }
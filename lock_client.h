@@ -4,21 +4,52 @@
 #define lock_client_h
 
 #include <string>
+#include <map>
+#include <pthread.h>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include <vector>
 
-// Client interface to the lock server
+// Client interface to the lock server.
+//
+// The lock service may be split over several lock_server processes,
+// each owning a disjoint part of the lock id space. The destination
+// is then a comma-separated list of [host:]port; every lock id is
+// routed to a server with a consistent hash, so all clients agree on
+// the owner no matter how they order the list.
 class lock_client {
  protected:
-  rpcc *cl;
+  struct shard {
+    shard(): cl(NULL), nheld(0) {}
+    std::string dst;   // canonical ip:port, what the ring hashes
+    rpcc *cl;
+    // lease keeping: while this client holds locks on the shard, the
+    // renewer thread sends a renew RPC whenever no other RPC went
+    // out to it for a third of the lease period.
+    int nheld;
+    struct timespec last_sent;
+  };
+  std::vector<shard> shards;
+  std::map<unsigned int, unsigned int> ring; // hash point -> shard
+
+  pthread_mutex_t m; // protects nheld, last_sent, stopping
+  pthread_cond_t renew_c;
+  bool stopping;
+  pthread_t renewer;
+  shard &route(lock_protocol::lockid_t);
+  void sent(shard &);
+  void renew_loop();
+
  public:
   lock_client(std::string d);
-  virtual ~lock_client() {};
+  virtual ~lock_client();
   virtual lock_protocol::status acquire(lock_protocol::lockid_t);
   virtual lock_protocol::status release(lock_protocol::lockid_t);
-  virtual lock_protocol::status stat(lock_protocol::lockid_t);
+  virtual lock_protocol::status stat(lock_protocol::lockid_t,
+                                    lock_protocol::statinfo &);
+  // the server a lock id is routed to, as ip:port (or unix:path)
+  std::string owner(lock_protocol::lockid_t);
 };
 
 
-#endif 
+#endif
@@ -16,7 +16,7 @@ lock_client *lc;
 int
 main(int argc, char *argv[])
 {
-  int r;
+  lock_protocol::statinfo st;
 
   if(argc != 2){
     fprintf(stderr, "Usage: %s [host:]port\n", argv[0]);
@@ -25,6 +25,6 @@ main(int argc, char *argv[])
 
   dst = argv[1];
   lc = new lock_client(dst);
-  r = lc->stat(1);
-  printf ("stat returned %d\n", r);
+  lc->stat(1, st);
+  printf ("stat returned %u acquires\n", st.total.acquires);
 }
@@ -13,8 +13,132 @@ class lock_protocol {
   enum rpc_numbers {
     acquire = 0x7001,
     release,
-    stat
+    stat,
+    renew
+  };
+
+  // a client that holds locks must be heard from (any RPC counts,
+  // see renew) at least this often, or the server reclaims its locks.
+  enum { lease_ms = 5000 };
+
+  // counters kept by the server for one lock, or summed over all
+  // locks. bucket i of a histogram counts samples of less than 2^i
+  // microseconds (and at least 2^(i-1)); the last bucket takes the rest.
+  enum { hist_buckets = 24, top_n = 10 };
+  struct lockstat {
+    lockstat(): lid(0), acquires(0), releases(0), reclaims(0), waiters(0),
+                max_waiters(0), wait_us(0), hold_us(0),
+                wait_hist(hist_buckets), hold_hist(hist_buckets) {}
+    lockid_t lid;
+    unsigned int acquires;
+    unsigned int releases;
+    unsigned int reclaims;       // taken back from expired leases
+    unsigned int waiters;        // clients blocked in acquire right now
+    unsigned int max_waiters;
+    unsigned long long wait_us;  // total time spent blocked in acquire
+    unsigned long long hold_us;  // total time held
+    std::vector<unsigned int> wait_hist;
+    std::vector<unsigned int> hold_hist;
+
+    // fold o's counters into this one
+    void merge(const lockstat &o) {
+      acquires += o.acquires;
+      releases += o.releases;
+      reclaims += o.reclaims;
+      waiters += o.waiters;
+      if (o.max_waiters > max_waiters)
+        max_waiters = o.max_waiters;
+      wait_us += o.wait_us;
+      hold_us += o.hold_us;
+      for (unsigned int i = 0; i < wait_hist.size() && i < o.wait_hist.size(); i++)
+        wait_hist[i] += o.wait_hist[i];
+      for (unsigned int i = 0; i < hold_hist.size() && i < o.hold_hist.size(); i++)
+        hold_hist[i] += o.hold_hist[i];
+    }
+    // order by wait time, then acquires: the most contended come first
+    static bool hotter(const lockstat &a, const lockstat &b) {
+      if (a.wait_us != b.wait_us)
+        return a.wait_us > b.wait_us;
+      return a.acquires > b.acquires;
+    }
+  };
+
+  // reply to stat(lid): the sum over all locks, and the counters of
+  // lid, or of the top_n locks with the most wait time if lid is 0.
+  struct statinfo {
+    lockstat total;
+    std::vector<lockstat> locks;
   };
 };
 
-#endif 
+// the first argument is always the caller's rpcc id
+RPC_PROC(lock_protocol::acquire, int, int, lock_protocol::lockid_t);
+RPC_PROC(lock_protocol::release, int, int, lock_protocol::lockid_t);
+RPC_PROC(lock_protocol::stat, lock_protocol::statinfo, int,
+         lock_protocol::lockid_t);
+RPC_PROC(lock_protocol::renew, int, int);
+
+inline unmarshall &
+operator>>(unmarshall &u, lock_protocol::lockstat &s)
+{
+  u >> s.lid;
+  u >> s.acquires;
+  u >> s.releases;
+  u >> s.reclaims;
+  u >> s.waiters;
+  u >> s.max_waiters;
+  u >> s.wait_us;
+  u >> s.hold_us;
+  s.wait_hist.clear();
+  u >> s.wait_hist;
+  s.hold_hist.clear();
+  u >> s.hold_hist;
+  return u;
+}
+
+inline int
+wire_size(const lock_protocol::lockstat &s)
+{
+  return 8 + 5 * 4 + 2 * 8 + wire_size(s.wait_hist) + wire_size(s.hold_hist);
+}
+
+inline marshall &
+operator<<(marshall &m, const lock_protocol::lockstat &s)
+{
+  m << s.lid;
+  m << s.acquires;
+  m << s.releases;
+  m << s.reclaims;
+  m << s.waiters;
+  m << s.max_waiters;
+  m << s.wait_us;
+  m << s.hold_us;
+  m << s.wait_hist;
+  m << s.hold_hist;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, lock_protocol::statinfo &s)
+{
+  u >> s.total;
+  s.locks.clear();
+  u >> s.locks;
+  return u;
+}
+
+inline int
+wire_size(const lock_protocol::statinfo &s)
+{
+  return wire_size(s.total) + wire_size(s.locks);
+}
+
+inline marshall &
+operator<<(marshall &m, const lock_protocol::statinfo &s)
+{
+  m << s.total;
+  m << s.locks;
+  return m;
+}
+
+#endif
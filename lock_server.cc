@@ -2,84 +2,393 @@
 
 #include "lock_server.h"
 #include <sstream>
+#include <algorithm>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include "method_thread.h"
+#include "slock.h"
+#include "gettime.h"
 #include "lang/verify.h"
 
-#define DEBUG
+// granularity of the lease timer wheel
+#define LEASE_TICK_MS 100
+
+// the lock table starts this big, and grows as it fills up
+#define LOCK_TABLE_SIZE (1 << 10)
+#define LOCK_STRIPES 64
+#define LEASE_SHARDS 16
+
+// low bit of lock_t::state: someone sleeps on the lock's stripe
+#define WAITERS 1ULL
 
 using namespace std;
 
+static unsigned long long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long
+now_ms()
+{
+    return now_us() / 1000;
+}
+
+static void
+hist_add(unsigned int *h, unsigned long long us)
+{
+    unsigned int b = 0;
+    while (us > 0 && b + 1 < lock_protocol::hist_buckets)
+    {
+        us >>= 1;
+        b++;
+    }
+    __atomic_add_fetch(&h[b], 1, __ATOMIC_RELAXED);
+}
+
+// the state word of a lock held by clt
+static unsigned long long
+holder(int clt)
+{
+    return ((unsigned long long)(unsigned int)clt + 1) << 1;
+}
+
+
 lock_server::lock_server():
-    nacquire (0), locks ()
+    nacquire (0), locks (LOCK_TABLE_SIZE), stripes (LOCK_STRIPES),
+    lease_shards (LEASE_SHARDS),
+    wheel (lock_protocol::lease_ms / LEASE_TICK_MS + 4),
+    wheel_tick (now_ms() / LEASE_TICK_MS), stopping (false)
 {
-    VERIFY(pthread_mutex_init(&mutex, NULL) == 0);
-    VERIFY(pthread_cond_init(&cond, 0) == 0);
+    for (unsigned int i = 0; i < stripes.size(); i++)
+    {
+        VERIFY(pthread_mutex_init(&stripes[i].m, NULL) == 0);
+        VERIFY(pthread_cond_init(&stripes[i].c, 0) == 0);
+    }
+    for (unsigned int i = 0; i < lease_shards.size(); i++)
+        VERIFY(pthread_mutex_init(&lease_shards[i].m, NULL) == 0);
+    VERIFY(pthread_mutex_init(&wheel_m, NULL) == 0);
+    VERIFY((sweeper_th = method_thread(this, false, &lock_server::sweeper)) != 0);
 }
 
 lock_server::~lock_server()
 {
-    VERIFY(pthread_mutex_destroy(&mutex) == 0);
-    VERIFY(pthread_cond_destroy(&cond) == 0);
+    {
+        ScopedLock ml(&wheel_m);
+        stopping = true;
+    }
+    VERIFY(pthread_join(sweeper_th, NULL) == 0);
+    for (unsigned int i = 0; i < stripes.size(); i++)
+    {
+        VERIFY(pthread_mutex_destroy(&stripes[i].m) == 0);
+        VERIFY(pthread_cond_destroy(&stripes[i].c) == 0);
+    }
+    for (unsigned int i = 0; i < lease_shards.size(); i++)
+        VERIFY(pthread_mutex_destroy(&lease_shards[i].m) == 0);
+    VERIFY(pthread_mutex_destroy(&wheel_m) == 0);
+}
+
+lock_server::stripe_t &
+lock_server::stripe(lock_protocol::lockid_t lid)
+{
+    return stripes[(lid ^ (lid >> 32)) % stripes.size()];
+}
+
+lock_server::lease_shard_t &
+lock_server::lease_shard(int clt)
+{
+    return lease_shards[(unsigned int)clt % lease_shards.size()];
+}
+
+// extend clt's lease. assumes clt's lease shard is locked.
+lock_server::lease_t &
+lock_server::extend(lease_shard_t &sh, int clt)
+{
+    lease_t &l = sh.leases[clt];
+    l.expiry = now_ms() + lock_protocol::lease_ms;
+    if (!l.scheduled)
+    {
+        l.scheduled = true;
+        schedule(clt, l.expiry, 0);
+    }
+    return l;
+}
+
+// extend clt's lease. must not be called with a stripe mutex held.
+void
+lock_server::touch(int clt)
+{
+    lease_shard_t &sh = lease_shard(clt);
+    ScopedLock ml(&sh.m);
+    extend(sh, clt);
+}
+
+// clt was just granted lid: extend its lease, and remember lid for
+// reclaim. a reclaim that runs between the grant and this does not
+// know lid yet, so it cannot take back a grant made under a lease
+// that is about to be renewed.
+void
+lock_server::granted(int clt, lock_protocol::lockid_t lid)
+{
+    lease_shard_t &sh = lease_shard(clt);
+    ScopedLock ml(&sh.m);
+    extend(sh, clt).held.insert(lid);
+}
+
+// clt released lid (or tried to): extend its lease, and forget lid
+// unless clt holds it again already; another of its threads may have
+// been granted lid in the meantime, and noted that first.
+void
+lock_server::released(int clt, lock_protocol::lockid_t lid, lock_t *l)
+{
+    lease_shard_t &sh = lease_shard(clt);
+    ScopedLock ml(&sh.m);
+    lease_t &le = extend(sh, clt);
+    if ((__atomic_load_n(&l->state, __ATOMIC_ACQUIRE) & ~WAITERS) != holder(clt))
+        le.held.erase(lid);
+}
+
+// put clt in the wheel slot of its expiry tick, but no earlier than
+// min_tick or the tick the sweeper is about to look at. the sweeper
+// re-checks the expiry when it reaches the slot, so a client that
+// renews is simply never moved. assumes clt's lease shard is locked.
+void
+lock_server::schedule(int clt, unsigned long long expiry,
+                      unsigned long long min_tick)
+{
+    ScopedLock ml(&wheel_m);
+    unsigned long long t = expiry / LEASE_TICK_MS + 1;
+    t = std::max(t, std::max(min_tick, wheel_tick));
+    wheel[t % wheel.size()].push_back(clt);
+}
+
+// free lid if it is still held by holder; the CAS makes sure only one
+// of a release and a reclaim racing on the same grant gets to do it.
+bool
+lock_server::drop(lock_protocol::lockid_t lid, lock_t *l,
+                  unsigned long long holder, bool reclaim)
+{
+    while (true)
+    {
+        unsigned long long st = __atomic_load_n(&l->state, __ATOMIC_ACQUIRE);
+        if ((st & ~WAITERS) != holder)
+            return false;
+        unsigned long long granted =
+            __atomic_load_n(&l->granted_at, __ATOMIC_RELAXED);
+        bool ok;
+        if (st & WAITERS)
+        {
+            // waiters set the bit under the stripe mutex right before
+            // sleeping, so clearing it under the same mutex cannot miss one
+            stripe_t &s = stripe(lid);
+            ScopedLock sl(&s.m);
+            ok = __atomic_compare_exchange_n(&l->state, &st, 0, false,
+                                             __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            if (ok)
+                VERIFY(pthread_cond_broadcast(&s.c) == 0);
+        }
+        else
+        {
+            ok = __atomic_compare_exchange_n(&l->state, &st, 0, false,
+                                             __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        }
+        if (ok)
+        {
+            unsigned long long held = now_us() - granted;
+            if (reclaim)
+                __atomic_add_fetch(&l->reclaims, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&l->releases, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&l->hold_us, held, __ATOMIC_RELAXED);
+            hist_add(l->hold_hist, held);
+            return true;
+        }
+    }
+}
+
+// clt's lease ran out: take back every lock it holds.
+// assumes clt's lease shard is locked, so that clt cannot be
+// granted a lock under a fresh lease while we sweep. held may
+// also list locks clt has released since; drop skips those.
+void
+lock_server::reclaim(int clt, lease_t &le)
+{
+    int n = 0;
+    unsigned long long me = holder(clt);
+    std::set<lock_protocol::lockid_t>::iterator it;
+    for (it = le.held.begin(); it != le.held.end(); it++)
+    {
+        lock_t *l = locks.find(*it);
+        if (l && drop(*it, l, me, true))
+            n++;
+    }
+    if (n > 0)
+        printf("lease of clt %d expired, reclaimed %d locks\n", clt, n);
+}
+
+void
+lock_server::sweeper()
+{
+    while (true)
+    {
+        usleep(LEASE_TICK_MS * 1000);
+
+        unsigned long long now = now_ms();
+        std::list<int> due;
+        {
+            ScopedLock ml(&wheel_m);
+            if (stopping)
+                break;
+            for (; wheel_tick <= now / LEASE_TICK_MS; wheel_tick++)
+                due.splice(due.end(), wheel[wheel_tick % wheel.size()]);
+        }
+        for (std::list<int>::iterator it = due.begin(); it != due.end(); it++)
+        {
+            lease_shard_t &sh = lease_shard(*it);
+            ScopedLock ml(&sh.m);
+            lease_t &l = sh.leases[*it];
+            if (l.expiry > now)
+                schedule(*it, l.expiry, now / LEASE_TICK_MS + 1);
+            else
+            {
+                reclaim(*it, l);
+                sh.leases.erase(*it);
+            }
+        }
+    }
 }
 
 lock_protocol::status
-lock_server::stat(int clt, lock_protocol::lockid_t lid, int &r)
+lock_server::stat(int clt, lock_protocol::lockid_t lid,
+                  lock_protocol::statinfo &r)
 {
     lock_protocol::status ret = lock_protocol::OK;
     printf("stat request from clt %d\n", clt);
-    r = nacquire;
+    touch(clt);
+
+    std::vector<lock_protocol::lockstat> all;
+    r.total = lock_protocol::lockstat();
+    for (unsigned int i = 0; i < locks.capacity(); i++)
+    {
+        lock_protocol::lockstat st;
+        lock_t *l = locks.at(i, &st.lid);
+        if (!l)
+            continue;
+        // counters are read one by one while others update them,
+        // so a line may be off by an in-flight acquire or release
+        st.acquires = __atomic_load_n(&l->acquires, __ATOMIC_RELAXED);
+        st.releases = __atomic_load_n(&l->releases, __ATOMIC_RELAXED);
+        st.reclaims = __atomic_load_n(&l->reclaims, __ATOMIC_RELAXED);
+        st.waiters = __atomic_load_n(&l->waiters, __ATOMIC_RELAXED);
+        st.max_waiters = __atomic_load_n(&l->max_waiters, __ATOMIC_RELAXED);
+        st.wait_us = __atomic_load_n(&l->wait_us, __ATOMIC_RELAXED);
+        st.hold_us = __atomic_load_n(&l->hold_us, __ATOMIC_RELAXED);
+        for (unsigned int b = 0; b < lock_protocol::hist_buckets; b++)
+        {
+            st.wait_hist[b] = __atomic_load_n(&l->wait_hist[b], __ATOMIC_RELAXED);
+            st.hold_hist[b] = __atomic_load_n(&l->hold_hist[b], __ATOMIC_RELAXED);
+        }
+        r.total.merge(st);
+        if (lid == 0)
+            all.push_back(st);
+        else if (lid == st.lid)
+            r.locks.push_back(st);
+    }
+    if (lid == 0)
+    {
+        unsigned int n = std::min((unsigned int)all.size(),
+                                  (unsigned int)lock_protocol::top_n);
+        std::partial_sort(all.begin(), all.begin() + n, all.end(),
+                          lock_protocol::lockstat::hotter);
+        r.locks.assign(all.begin(), all.begin() + n);
+    }
     return ret;
 }
 
 lock_protocol::status
 lock_server::acquire(int clt, lock_protocol::lockid_t lid, int &r)
 {
-    ScopedLock ml(&mutex);
-    while (true)
+    // the lease is renewed once the lock is granted (see granted);
+    // while it waits, clt's renewer keeps it alive
+    lock_t *l = locks.get(lid);
+
+    unsigned long long start = now_us();
+    unsigned long long me = holder(clt);
+    unsigned long long st = 0;
+    if (!__atomic_compare_exchange_n(&l->state, &st, me, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
     {
-#ifdef DEBUG
-        cout<<clt<<" asks for lock "<<lid<<endl;
-#endif
-        if (locks.find(lid) == locks.end() || !locks[lid])
-        {
-            locks[lid] = true;
-            locks_owner[lid] = clt;
-            r = 0;
-#ifdef DEBUG
-            cout<<clt<<" be granted with lock "<<lid<<endl;
-#endif
-            break;
-        }
-        else
+        stripe_t &s = stripe(lid);
+        VERIFY(pthread_mutex_lock(&s.m) == 0);
+        // waiters only changes under the stripe mutex
+        unsigned int w = __atomic_add_fetch(&l->waiters, 1, __ATOMIC_RELAXED);
+        if (w > l->max_waiters)
+            __atomic_store_n(&l->max_waiters, w, __ATOMIC_RELAXED);
+        while (true)
         {
-            VERIFY(pthread_cond_wait(&cond, &mutex) == 0);
+            st = __atomic_load_n(&l->state, __ATOMIC_ACQUIRE);
+            if (st == 0)
+            {
+                // keep the waiters bit for whoever is still asleep
+                unsigned long long next = l->waiters > 1 ? me | WAITERS : me;
+                if (__atomic_compare_exchange_n(&l->state, &st, next, false,
+                                                __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED))
+                    break;
+                continue;
+            }
+            if (!(st & WAITERS) &&
+                !__atomic_compare_exchange_n(&l->state, &st, st | WAITERS,
+                                             false, __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED))
+                continue;
+            VERIFY(pthread_cond_wait(&s.c, &s.m) == 0);
         }
+        __atomic_sub_fetch(&l->waiters, 1, __ATOMIC_RELAXED);
+        VERIFY(pthread_mutex_unlock(&s.m) == 0);
     }
+
+    // the wait may have outlasted the lease; granted renews it
+    granted(clt, lid);
+
+    unsigned long long now = now_us();
+    __atomic_store_n(&l->granted_at, now, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&l->acquires, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&l->wait_us, now - start, __ATOMIC_RELAXED);
+    hist_add(l->wait_hist, now - start);
+    __atomic_add_fetch(&nacquire, 1, __ATOMIC_RELAXED);
+    r = 0;
     return lock_protocol::OK;
 }
 
 lock_protocol::status
 lock_server::release(int clt, lock_protocol::lockid_t lid, int &r)
 {
-    ScopedLock ml(&mutex);
-    if (locks.find(lid) == locks.end() || !locks[lid] || locks_owner[lid] != clt)
+    lock_t *l = locks.find(lid);
+    if (!l)
     {
-#ifdef DEBUG
-        cout<<"error!"<<endl;
-#endif
-        return lock_protocol::RPCERR;
+        touch(clt);
+        return lock_protocol::NOENT;
     }
-    else
+    bool ok = drop(lid, l, holder(clt), false);
+    released(clt, lid, l);
+    if (!ok)
     {
-#ifdef DEBUG
-        cout<<"releasing "<<lid<<" of "<<clt<<endl;
-#endif
-        locks[lid] = false;
-        locks_owner[lid] = 0;
-        r = 0;
-        VERIFY(pthread_cond_broadcast(&cond) == 0);
+        // most likely clt's lease expired and the lock was reclaimed
+        return lock_protocol::NOENT;
     }
+    r = 0;
+    return lock_protocol::OK;
+}
+
+lock_protocol::status
+lock_server::renew(int clt, int &r)
+{
+    touch(clt);
+    r = 0;
     return lock_protocol::OK;
 }
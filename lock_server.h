@@ -6,9 +6,13 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <list>
+#include <vector>
 #include <pthread.h>
 #include "lock_protocol.h"
 #include "lock_client.h"
+#include "lock_table.h"
 #include "rpc.h"
 
 class lock_server {
@@ -17,17 +21,79 @@ class lock_server {
   int nacquire;
 
  private:
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-  std::map<int, bool> locks;
-  std::map<int, int> locks_owner;
+  // per-lock state. state packs the holder (client id + 1, so 0 means
+  // free) above a waiters bit; acquire and release flip it with a CAS
+  // and only fall back to a mutex when someone has to sleep or be woken.
+  // The counters are the contention profile (see stat), updated with
+  // atomic adds; granted_at is when (us) the current holder got it.
+  struct lock_t {
+    unsigned long long state;
+    unsigned long long granted_at;
+    unsigned int acquires;
+    unsigned int releases;
+    unsigned int reclaims;
+    unsigned int waiters;
+    unsigned int max_waiters;
+    unsigned long long wait_us;
+    unsigned long long hold_us;
+    unsigned int wait_hist[lock_protocol::hist_buckets];
+    unsigned int hold_hist[lock_protocol::hist_buckets];
+  };
+  lock_table<lock_t> locks;
+
+  // waiters sleep on the condition variable of their lock's stripe
+  struct stripe_t {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+  };
+  std::vector<stripe_t> stripes;
+  stripe_t &stripe(lock_protocol::lockid_t lid);
+
+  bool drop(lock_protocol::lockid_t lid, lock_t *l, unsigned long long holder,
+            bool reclaim);
+
+  // lease state. every RPC from a client pushes its lease expiry
+  // forward; leases are sharded by client, each shard under its own
+  // mutex. clients are also hashed into a timer wheel by expiry tick;
+  // the sweeper thread walks the wheel, re-hashes clients that renewed
+  // in the meantime and reclaims the locks of the ones whose lease
+  // really ran out. each lease lists the locks its client was granted,
+  // so a reclaim only looks at those.
+  struct lease_t {
+    lease_t(): expiry(0), scheduled(false) {}
+    unsigned long long expiry; // ms on the monotonic clock
+    bool scheduled;            // client sits in a wheel slot
+    std::set<lock_protocol::lockid_t> held;
+  };
+  struct lease_shard_t {
+    pthread_mutex_t m;
+    std::map<int, lease_t> leases;
+  };
+  std::vector<lease_shard_t> lease_shards;
+  pthread_mutex_t wheel_m; // protects wheel, wheel_tick, stopping
+  std::vector<std::list<int> > wheel;
+  unsigned long long wheel_tick; // next tick the sweeper looks at
+  bool stopping;
+  pthread_t sweeper_th;
+
+  lease_shard_t &lease_shard(int clt);
+  lease_t &extend(lease_shard_t &sh, int clt);
+  void touch(int clt);
+  void granted(int clt, lock_protocol::lockid_t lid);
+  void released(int clt, lock_protocol::lockid_t lid, lock_t *l);
+  void schedule(int clt, unsigned long long expiry,
+                unsigned long long min_tick);
+  void reclaim(int clt, lease_t &le);
+  void sweeper();
 
  public:
   lock_server();
   ~lock_server();
-  lock_protocol::status stat(int clt, lock_protocol::lockid_t lid, int &);
+  lock_protocol::status stat(int clt, lock_protocol::lockid_t lid,
+                             lock_protocol::statinfo &);
   lock_protocol::status acquire(int clt, lock_protocol::lockid_t lid, int &);
   lock_protocol::status release(int clt, lock_protocol::lockid_t lid, int &);
+  lock_protocol::status renew(int clt, int &);
 };
 
 #endif
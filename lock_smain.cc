@@ -34,9 +34,13 @@ main(int argc, char *argv[])
 #ifndef RSM
   lock_server ls;
   rpcs server(atoi(argv[1]), count);
-  server.reg(lock_protocol::stat, &ls, &lock_server::stat);
-  server.reg(lock_protocol::acquire, &ls, &lock_server::acquire);
-  server.reg(lock_protocol::release, &ls, &lock_server::release);
+  server.reg<lock_protocol::stat>(&ls, &lock_server::stat);
+  server.reg<lock_protocol::acquire>(&ls, &lock_server::acquire);
+  server.reg<lock_protocol::release>(&ls, &lock_server::release);
+  server.reg<lock_protocol::renew>(&ls, &lock_server::renew);
+  // acquire waits for the holder; keep it from tying up the threads
+  // that releases need
+  server.set_procflags(lock_protocol::acquire, rpcs::PROC_BLOCKING);
 #endif
 
 
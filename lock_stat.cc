@@ -0,0 +1,75 @@
+//
+// Lock server statistics: polls the stat RPC and prints the
+// aggregate counters and the most contended locks.
+//
+
+#include "lock_protocol.h"
+#include "lock_client.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+static void
+print_hist(const char *name, const std::vector<unsigned int> &h)
+{
+  printf("  %s:", name);
+  for (unsigned int i = 0; i < h.size(); i++) {
+    if (!h[i])
+      continue;
+    if (i + 1 == h.size())
+      printf(" >=%uus:%u", 1U << (i - 1), h[i]);
+    else
+      printf(" <%uus:%u", 1U << i, h[i]);
+  }
+  printf("\n");
+}
+
+static void
+print_line(const char *name, const lock_protocol::lockstat &s)
+{
+  printf("%-18s %9u %9u %8u %7u %7u %12llu %12llu\n", name,
+         s.acquires, s.releases, s.reclaims, s.waiters, s.max_waiters,
+         s.acquires ? s.wait_us / s.acquires : 0,
+         s.releases ? s.hold_us / s.releases : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc < 2 || argc > 4){
+    fprintf(stderr, "Usage: %s [host:]port [lid] [interval]\n", argv[0]);
+    fprintf(stderr, "  lid 0 (the default) lists the %d most contended locks;\n"
+            "  with an interval (seconds) the server is polled forever.\n",
+            (int) lock_protocol::top_n);
+    exit(1);
+  }
+
+  lock_protocol::lockid_t lid = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+  int interval = argc > 3 ? atoi(argv[3]) : 0;
+  lock_client lc(argv[1]);
+
+  while (1) {
+    lock_protocol::statinfo st;
+    lc.stat(lid, st);
+
+    printf("%-18s %9s %9s %8s %7s %7s %12s %12s\n", "lock", "acquires",
+           "releases", "reclaims", "waiting", "maxwait", "avg-wait-us",
+           "avg-hold-us");
+    print_line("total", st.total);
+    for (unsigned int i = 0; i < st.locks.size(); i++) {
+      char name[32];
+      snprintf(name, sizeof(name), "%016llx", st.locks[i].lid);
+      print_line(name, st.locks[i]);
+    }
+    print_hist("wait", st.total.wait_hist);
+    print_hist("hold", st.total.hold_hist);
+
+    if (interval <= 0)
+      break;
+    printf("\n");
+    sleep(interval);
+  }
+  return 0;
+}
@@ -0,0 +1,182 @@
+// concurrent hash table for the lock server
+
+#ifndef lock_table_h
+#define lock_table_h
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "lock_protocol.h"
+#include "lang/verify.h"
+
+// An open-addressed (linear probing) table from 64-bit lock ids to
+// entries of type V that grows without moving entries. Lookups and
+// inserts never take a lock: a free slot is claimed with a CAS on its
+// state and published once the key is written. Slots are never
+// removed, so a V * stays valid for the life of the table, and V must
+// bring its own synchronization. V must be plain data that is valid
+// when zero-filled.
+//
+// The table is a list of segments, each twice the size of the one
+// before. A lid lives in the first segment with a free slot among the
+// PROBE_LIMIT slots after its hash; when the last segment has none, a
+// new one is added. Slots only ever fill up, so two inserts of the same
+// lid always try the same slots in the same order, and a lookup that
+// meets a free slot knows the lid is in no later segment either.
+template<class V>
+class lock_table {
+ public:
+  lock_table(unsigned int capacity);
+  ~lock_table();
+
+  // the entry for lid, inserting it if needed. never NULL.
+  V *get(lock_protocol::lockid_t lid);
+  // the entry for lid, or NULL if there is none.
+  V *find(lock_protocol::lockid_t lid);
+
+  // for sweeps over all entries: slot i's entry and its lid, or NULL
+  // if slot i is not (yet) in use. capacity() grows with the table.
+  unsigned int capacity();
+  V *at(unsigned int i, lock_protocol::lockid_t *lid);
+
+ private:
+  enum { EMPTY = 0, BUSY, FULL };
+  enum { PROBE_LIMIT = 32, MAX_SEGS = 20 };
+  struct slot {
+    int state;
+    lock_protocol::lockid_t lid;
+    V val;
+  };
+  slot *segs_[MAX_SEGS];  // segment k has base_ << k slots
+  unsigned int nsegs_;    // segments in use; only grows
+  unsigned int base_;
+  pthread_mutex_t grow_m_;
+
+  V *lookup(lock_protocol::lockid_t lid, bool insert);
+  void grow(unsigned int n);
+  static unsigned int hash(lock_protocol::lockid_t);
+};
+
+template<class V>
+lock_table<V>::lock_table(unsigned int capacity)
+  : nsegs_(0), base_(capacity)
+{
+  VERIFY(capacity > 0 && (capacity & (capacity - 1)) == 0);
+  // slot numbers of a full table must fit an unsigned int
+  VERIFY(((unsigned long long) capacity << MAX_SEGS) <= (1ULL << 32));
+  VERIFY(pthread_mutex_init(&grow_m_, NULL) == 0);
+  grow(0);
+}
+
+template<class V>
+lock_table<V>::~lock_table()
+{
+  for (unsigned int k = 0; k < nsegs_; k++)
+    free(segs_[k]);
+  VERIFY(pthread_mutex_destroy(&grow_m_) == 0);
+}
+
+template<class V> unsigned int
+lock_table<V>::hash(lock_protocol::lockid_t lid)
+{
+  lid ^= lid >> 33;
+  lid *= 0xff51afd7ed558ccdULL;
+  lid ^= lid >> 33;
+  return (unsigned int) lid;
+}
+
+// add segment n, unless another thread already has
+template<class V> void
+lock_table<V>::grow(unsigned int n)
+{
+  VERIFY(pthread_mutex_lock(&grow_m_) == 0);
+  if (__atomic_load_n(&nsegs_, __ATOMIC_ACQUIRE) == n)
+  {
+    VERIFY(n < MAX_SEGS);
+    // calloc'ed memory is zero-filled, and for a big segment the
+    // pages are only backed once a slot on them is used.
+    segs_[n] = (slot *) calloc((size_t) base_ << n, sizeof(slot));
+    VERIFY(segs_[n]);
+    __atomic_store_n(&nsegs_, n + 1, __ATOMIC_RELEASE);
+  }
+  VERIFY(pthread_mutex_unlock(&grow_m_) == 0);
+}
+
+template<class V> V *
+lock_table<V>::lookup(lock_protocol::lockid_t lid, bool insert)
+{
+  unsigned int h = hash(lid);
+  for (unsigned int k = 0; ; k++)
+  {
+    if (k == __atomic_load_n(&nsegs_, __ATOMIC_ACQUIRE))
+    {
+      if (!insert)
+        return NULL;
+      grow(k);
+    }
+    slot *seg = segs_[k];
+    unsigned int mask = (base_ << k) - 1;
+    for (unsigned int i = 0; i < PROBE_LIMIT && i <= mask; i++)
+    {
+      slot *s = &seg[(h + i) & mask];
+      int st = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+      if (st == EMPTY)
+      {
+        if (!insert)
+          return NULL;
+        st = EMPTY;
+        if (__atomic_compare_exchange_n(&s->state, &st, (int) BUSY, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+          s->lid = lid;
+          __atomic_store_n(&s->state, (int) FULL, __ATOMIC_RELEASE);
+          return &s->val;
+        }
+        // lost the slot to another insert; st says what it holds now
+      }
+      // a concurrent insert is writing the key; it is only a few
+      // instructions away from publishing it
+      while (st == BUSY)
+        st = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+      if (s->lid == lid)
+        return &s->val;
+    }
+  }
+}
+
+template<class V> V *
+lock_table<V>::get(lock_protocol::lockid_t lid)
+{
+  return lookup(lid, true);
+}
+
+template<class V> V *
+lock_table<V>::find(lock_protocol::lockid_t lid)
+{
+  return lookup(lid, false);
+}
+
+template<class V> unsigned int
+lock_table<V>::capacity()
+{
+  return base_ * ((1U << __atomic_load_n(&nsegs_, __ATOMIC_ACQUIRE)) - 1);
+}
+
+template<class V> V *
+lock_table<V>::at(unsigned int i, lock_protocol::lockid_t *lid)
+{
+  unsigned int k = 0;
+  while (k < MAX_SEGS && i >= base_ << k)
+  {
+    i -= base_ << k;
+    k++;
+  }
+  if (k >= __atomic_load_n(&nsegs_, __ATOMIC_ACQUIRE))
+    return NULL;
+  slot *s = &segs_[k][i];
+  if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != FULL)
+    return NULL;
+  *lid = s->lid;
+  return &s->val;
+}
+
+#endif
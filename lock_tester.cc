@@ -6,6 +6,7 @@
 #include "lock_client.h"
 #include "rpc.h"
 #include "jsl_log.h"
+#include "slock.h"
 #include <arpa/inet.h>
 #include <vector>
 #include <stdlib.h>
@@ -142,6 +143,46 @@ test5(void *x)
   return 0;
 }
 
+// a client that grabs a lock and then goes silent, as if it had
+// crashed. the server must hand the lock to someone else once the
+// lease runs out.
+void
+test6(void)
+{
+  printf ("test6: dead client holding c, lease reclaims it\n");
+  // with several servers, die holding c on the one that owns it
+  rpcc *dead = new rpcc(lc[0]->owner(c));
+  VERIFY(dead->bind() == 0);
+  int r;
+  VERIFY(dead->call<lock_protocol::acquire>(dead->id(), c, r) ==
+         lock_protocol::OK);
+
+  time_t t0 = time(0);
+  lc[0]->acquire(c);
+  check_grant(c);
+  time_t waited = time(0) - t0;
+  printf ("test6: got c after %d s\n", (int) waited);
+  VERIFY(waited <= lock_protocol::lease_ms / 1000 + 2);
+  check_release(c);
+  lc[0]->release(c);
+}
+
+// more distinct lock ids than the server's lock table starts with,
+// and than it used to hold at most
+int nids = 70000;
+
+void *
+test7(void *x)
+{
+  int i = * (int *) x;
+  for (int k = i; k < nids; k += nt) {
+    lock_protocol::lockid_t lid = 0x7000000000000000ULL + k;
+    lc[i]->acquire(lid);
+    lc[i]->release(lid);
+  }
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -164,8 +205,8 @@ main(int argc, char *argv[])
 
     if (argc > 2) {
       test = atoi(argv[2]);
-      if(test < 1 || test > 5){
-        printf("Test number must be between 1 and 5\n");
+      if(test < 1 || test > 7){
+        printf("Test number must be between 1 and 7\n");
         exit(1);
       }
     }
@@ -233,6 +274,22 @@ main(int argc, char *argv[])
       }
     }
 
+    if(!test || test == 6){
+      test6();
+    }
+
+    if(!test || test == 7){
+      printf("test 7: %d distinct locks\n", nids);
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test7, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+    }
+
     printf ("%s: passed all tests successfully\n", argv[0]);
 
 }
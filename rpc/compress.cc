@@ -0,0 +1,158 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "compress.h"
+
+#define HASH_BITS 12
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5 //the tail is always literals, so matches stop short
+#define SKIP_SHIFT 6 //after 2^SKIP_SHIFT misses in a row, look at every other byte, ...
+
+// positions in the input by hash of the 4 bytes there; per thread, as
+// senders may run on small stacks
+static __thread int table[1 << HASH_BITS];
+
+static inline uint32_t
+load32(const char *p)
+{
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static inline int
+hash(uint32_t x)
+{
+	return (x * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// a length of 15 or more, continued after the token
+static inline char *
+put_len(char *op, int n)
+{
+	for (n -= 15; n >= 255; n -= 255)
+		*op++ = (char)255;
+	*op++ = (char)n;
+	return op;
+}
+
+static char *
+put_seq(char *op, const char *lit, int nlit, int off, int mlen)
+{
+	char *token = op++;
+	int m = mlen ? mlen - LZ_MIN_MATCH : 0;
+	*token = (char)(((nlit < 15 ? nlit : 15) << 4) | (m < 15 ? m : 15));
+	if (nlit >= 15)
+		op = put_len(op, nlit);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen) {
+		*op++ = (char)(off & 0xff);
+		*op++ = (char)(off >> 8);
+		if (m >= 15)
+			op = put_len(op, m);
+	}
+	return op;
+}
+
+int
+rpc_compress_bound(int n)
+{
+	return n + n / 255 + 16;
+}
+
+int
+rpc_compress(const char *src, int n, char *dst)
+{
+	memset(table, 0xff, sizeof(table)); //-1: no position yet
+
+	const char *ip = src, *anchor = src;
+	int mflimit = n - LAST_LITERALS - LZ_MIN_MATCH; //last match start
+	int misses = 0;
+	char *op = dst;
+
+	while (ip - src <= mflimit) {
+		uint32_t x = load32(ip);
+		int h = hash(x);
+		int ref = table[h];
+		table[h] = ip - src;
+		if (ref < 0 || ip - (src + ref) > MAX_OFFSET ||
+		    load32(src + ref) != x) {
+			// incompressible input is skipped over faster and faster
+			ip += 1 + (misses++ >> SKIP_SHIFT);
+			continue;
+		}
+		misses = 0;
+		// extend the match, but leave the last bytes as literals
+		const char *r = src + ref + LZ_MIN_MATCH;
+		const char *p = ip + LZ_MIN_MATCH;
+		const char *end = src + n - LAST_LITERALS;
+		while (p < end && *p == *r) {
+			p++;
+			r++;
+		}
+		op = put_seq(op, anchor, ip - anchor, ip - (src + ref), p - ip);
+		ip = anchor = p;
+	}
+	op = put_seq(op, anchor, src + n - anchor, 0, 0);
+	return op - dst;
+}
+
+// a length continued after the token; -1 if the input runs out
+static inline int
+get_len(const unsigned char **ip, const unsigned char *iend, int n)
+{
+	if (n < 15)
+		return n;
+	int b;
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		n += b;
+		if (n > (1 << 30))
+			return -1;
+	} while (b == 255);
+	return n;
+}
+
+int
+rpc_decompress(const char *src, int n, char *dst, int cap)
+{
+	const unsigned char *ip = (const unsigned char *)src;
+	const unsigned char *iend = ip + n;
+	char *op = dst, *oend = dst + cap;
+
+	while (ip < iend) {
+		int token = *ip++;
+		int nlit = get_len(&ip, iend, token >> 4);
+		if (nlit < 0 || nlit > iend - ip || nlit > oend - op)
+			return -1;
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == iend)
+			break; //the last sequence has no match
+		if (iend - ip < 2)
+			return -1;
+		int off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		int mlen = get_len(&ip, iend, token & 15);
+		if (mlen < 0)
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (off == 0 || off > op - dst || mlen > oend - op)
+			return -1;
+		// the match may overlap what it produces (a run), so copy
+		// forward a byte at a time unless it is far enough back
+		const char *m = op - off;
+		if (off >= mlen) {
+			memcpy(op, m, mlen);
+			op += mlen;
+		} else {
+			while (mlen--)
+				*op++ = *m++;
+		}
+	}
+	return op - dst;
+}
@@ -0,0 +1,33 @@
+#ifndef compress_h
+#define compress_h
+
+// A small LZ77 block codec in the style of LZ4, for PDU payloads.
+//
+// A block is a list of sequences. Each starts with a token byte: the
+// high nibble is the number of literals, the low nibble the match
+// length minus MIN_MATCH; a nibble of 15 is continued in following
+// bytes, each added on until one is below 255. Then come the
+// literals, and, unless the block ends there, the match offset (2
+// bytes, little-endian, back from the current output position). The
+// last sequence has literals only.
+//
+// The compressor is greedy with a single hash table of recent
+// positions, so it trades ratio for speed the way LZ4 does; text
+// and logs typically shrink 2-4x.
+
+enum {
+	LZ_MIN_MATCH = 4,
+};
+
+// the most rpc_compress can write for n bytes of input
+int rpc_compress_bound(int n);
+
+// compress src[0..n) into dst, which has rpc_compress_bound(n)
+// bytes; returns the size of the block
+int rpc_compress(const char *src, int n, char *dst);
+
+// decompress the block src[0..n) into dst; returns the bytes
+// written, or -1 if the block is damaged or needs more than cap
+int rpc_decompress(const char *src, int n, char *dst, int cap);
+
+#endif
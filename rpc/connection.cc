@@ -1,24 +1,236 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <netinet/tcp.h>
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
 
 #include "method_thread.h"
 #include "connection.h"
+#include "marshall.h"
 #include "slock.h"
 #include "pollmgr.h"
 #include "jsl_log.h"
 #include "gettime.h"
+#include "crc32c.h"
+#include "compress.h"
 #include "lang/verify.h"
 
 #define MAX_PDU (10<<20) //maximum PDF is 10M
+#define MAX_QUEUED (4<<20) //senders block while more than this is queued
+#define MAX_IOV 64 //PDUs handed to a single writev
+#define IBUF_SZ (16<<10) //input buffer; larger PDUs are read directly
+#define READ_BUDGET 16 //reads per read_cb before other fds get a turn
+#define GC_EVERY 64 //accepts between sweeps for dead connections
+#define BATCH_MAX 4096 //larger PDUs are written at once even when batching
 
+//the high bits of a PDU's length word are flags
+#define PDU_COMPRESSED 0x40000000 //the body is compressed
+#define PDU_INFLATES 0x20000000 //the sender takes compressed PDUs
+#define PDU_SZ_MASK 0x0fffffff
 
-connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+//where the body of a PDU starts: after the length word and checksum
+#if RPC_CHECKSUMMING
+#define BODY_OFF (sizeof(rpc_sz_t) + sizeof(rpc_checksum_t))
+#else
+#define BODY_OFF sizeof(rpc_sz_t)
+#endif
+
+unsigned long long rpc_write_calls;
+unsigned long long rpc_read_calls;
+
+static int compress_min_;
+static int batch_us_;
+static pthread_once_t compress_once_ = PTHREAD_ONCE_INIT;
+
+static void
+compress_init()
+{
+	char *env = getenv("RPC_COMPRESS");
+	if (env != NULL)
+		compress_min_ = atoi(env);
+	env = getenv("RPC_BATCH_US");
+	if (env != NULL)
+		batch_us_ = atoi(env);
+}
+
+int
+get_compression()
+{
+	pthread_once(&compress_once_, compress_init);
+	return __atomic_load_n(&compress_min_, __ATOMIC_RELAXED);
+}
+
+void
+set_compression(int min)
+{
+	pthread_once(&compress_once_, compress_init);
+	__atomic_store_n(&compress_min_, min, __ATOMIC_RELAXED);
+}
+
+int
+get_batching()
+{
+	pthread_once(&compress_once_, compress_init);
+	return __atomic_load_n(&batch_us_, __ATOMIC_RELAXED);
+}
+
+void
+set_batching(int us)
+{
+	pthread_once(&compress_once_, compress_init);
+	__atomic_store_n(&batch_us_, us, __ATOMIC_RELAXED);
+}
+
+static unsigned long long
+now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void
+count_syscall(unsigned long long *c)
+{
+	__atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+}
+
+#if RPC_CHECKSUMMING
+#define CK_OFF BODY_OFF
+
+// the CRC-32C of the PDU in iov past CK_OFF, as it goes in the
+// checksum slot: network byte order in the first 4 bytes, then zeros
+static void
+pdu_checksum(const struct iovec *iov, int niov, char *ck)
+{
+	uint32_t crc = 0;
+	size_t skip = CK_OFF;
+	for (int i = 0; i < niov; i++) {
+		size_t len = iov[i].iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		crc = crc32c(crc, (char *)iov[i].iov_base + skip, len - skip);
+		skip = 0;
+	}
+	crc = htonl(crc);
+	memset(ck, 0, sizeof(rpc_checksum_t));
+	memcpy(ck, &crc, sizeof(crc));
+}
+
+static void
+pdu_seal_iov(const struct iovec *iov, int niov)
+{
+	VERIFY(iov[0].iov_len >= CK_OFF);
+	pdu_checksum(iov, niov, (char *)iov[0].iov_base + sizeof(rpc_sz_t));
+}
+
+static bool
+pdu_check(char *b, int sz)
+{
+	if (sz < (int)CK_OFF)
+		return false;
+	struct iovec iov;
+	iov.iov_base = b;
+	iov.iov_len = sz;
+	char ck[sizeof(rpc_checksum_t)];
+	pdu_checksum(&iov, 1, ck);
+	if (memcmp(ck, b + sizeof(rpc_sz_t), sizeof(ck)) != 0) {
+		jsl_log(JSL_DBG_OFF, "connection::readpdu bad checksum, %d byte pdu\n", sz);
+		return false;
+	}
+	return true;
+}
+#endif
+
+void
+pdu_seal(char *b, int sz)
+{
+#if RPC_CHECKSUMMING
+	struct iovec iov;
+	iov.iov_base = b;
+	iov.iov_len = sz;
+	pdu_seal_iov(&iov, 1);
+#endif
+}
+
+static sockopts opts_;
+static pthread_mutex_t opts_m_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t opts_once_ = PTHREAD_ONCE_INIT;
+
+static void
+sockopts_init()
+{
+	opts_.nodelay = true;
+	opts_.sndbuf = 0;
+	opts_.rcvbuf = 0;
+	opts_.busy_poll = 0;
+	char *env = getenv("RPC_NODELAY");
+	if (env != NULL)
+		opts_.nodelay = atoi(env) != 0;
+	if ((env = getenv("RPC_SNDBUF")) != NULL)
+		opts_.sndbuf = atoi(env);
+	if ((env = getenv("RPC_RCVBUF")) != NULL)
+		opts_.rcvbuf = atoi(env);
+	if ((env = getenv("RPC_BUSY_POLL")) != NULL)
+		opts_.busy_poll = atoi(env);
+}
+
+sockopts
+get_sockopts()
+{
+	pthread_once(&opts_once_, sockopts_init);
+	ScopedLock ml(&opts_m_);
+	return opts_;
+}
+
+void
+set_sockopts(const sockopts &o)
+{
+	pthread_once(&opts_once_, sockopts_init);
+	ScopedLock ml(&opts_m_);
+	opts_ = o;
+}
+
+// buffer sizes go on before connect or listen, so that TCP can pick
+// a window scale to match. failures are logged and otherwise
+// ignored; the socket still works with the kernel's defaults.
+static void
+apply_sockopts(int s, bool tcp)
+{
+	sockopts o = get_sockopts();
+	if (o.sndbuf > 0 &&
+	    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &o.sndbuf, sizeof(o.sndbuf)) < 0)
+		jsl_log(JSL_DBG_1, "apply_sockopts: SO_SNDBUF %d errno %d\n",
+				o.sndbuf, errno);
+	if (o.rcvbuf > 0 &&
+	    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &o.rcvbuf, sizeof(o.rcvbuf)) < 0)
+		jsl_log(JSL_DBG_1, "apply_sockopts: SO_RCVBUF %d errno %d\n",
+				o.rcvbuf, errno);
+	if (!tcp)
+		return;
+	int nodelay = o.nodelay;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+#ifdef SO_BUSY_POLL
+	if (o.busy_poll > 0 &&
+	    setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &o.busy_poll,
+		    sizeof(o.busy_poll)) < 0)
+		jsl_log(JSL_DBG_1, "apply_sockopts: SO_BUSY_POLL %d errno %d\n",
+				o.busy_poll, errno);
+#endif
+}
+
+
+connection::connection(chanmgr *m1, int f1, int l1, PollMgr *pm)
+: mgr_(m1), pm_(pm ? pm : PollMgr::Next()), fd_(f1), dead_(false), wq_bytes_(0), senders_(0),
+  last_send_us_(0), ilen_(0), peer_inflates_(0), waiters_(0), refno_(1), lossy_(l1)
 {
 
 	int flags = fcntl(fd_, F_GETFL, NULL);
@@ -26,14 +238,15 @@ connection::connection(chanmgr *m1, int f1, int l1)
 	fcntl(fd_, F_SETFL, flags);
 
 	signal(SIGPIPE, SIG_IGN);
+	ibuf_ = NULL;
+	last_sender_ = pthread_self();
 	VERIFY(pthread_mutex_init(&m_,0)==0);
 	VERIFY(pthread_mutex_init(&ref_m_,0)==0);
 	VERIFY(pthread_cond_init(&send_wait_,0)==0);
-	VERIFY(pthread_cond_init(&send_complete_,0)==0);
  
         VERIFY(gettimeofday(&create_time_, NULL) == 0); 
 
-	PollMgr::Instance()->add_callback(fd_, CB_RDONLY, this);
+	pm_->add_callback(fd_, CB_RDONLY, this);
 }
 
 connection::~connection()
@@ -42,10 +255,11 @@ connection::~connection()
 	VERIFY(pthread_mutex_destroy(&m_)== 0);
 	VERIFY(pthread_mutex_destroy(&ref_m_)== 0);
 	VERIFY(pthread_cond_destroy(&send_wait_) == 0);
-	VERIFY(pthread_cond_destroy(&send_complete_) == 0);
-	if (rpdu_.buf)
-		free(rpdu_.buf);
-	VERIFY(!wpdu_.buf);
+	pdu_free(rpdu_.buf);
+	pdu_free(ibuf_);
+	std::list<charbuf>::iterator i;
+	for (i = wq_.begin(); i != wq_.end(); i++)
+		pdu_free(i->buf);
 	close(fd_);
 }
 
@@ -71,13 +285,14 @@ connection::closeconn()
 		if (!dead_) {
 			dead_ = true;
 			shutdown(fd_,SHUT_RDWR);
+			VERIFY(pthread_cond_broadcast(&send_wait_) == 0);
 		}else{
 			return;
 		}
 	}
 	//after block_remove_fd, select will never wait on fd_ 
 	//and no callbacks will be active
-	PollMgr::Instance()->block_remove_fd(fd_);
+	pm_->block_remove_fd(fd_);
 }
 
 void
@@ -120,21 +335,141 @@ connection::compare(connection *another)
         return 0;
 }
 
+// send a PDU. b must have room for the length word in front (the
+// word itself is sent from elsewhere; b's slot is left as it is); the
+// caller may free b when send returns. returns once the PDU is written
+// or queued behind earlier ones, so a true return does not mean the
+// peer will get it: the connection may still die before the queue drains.
 bool
 connection::send(char *b, int sz)
 {
+	struct iovec iov;
+	iov.iov_base = b;
+	iov.iov_len = sz;
+	return send(&iov, 1);
+}
+
+// send a PDU made of several segments, without first copying them
+// together. the first segment has room for the length word in front.
+bool
+connection::send(const struct iovec *iov, int niov)
+{
+#if RPC_CHECKSUMMING
+	pdu_seal_iov(iov, niov);
+#endif
+	return sendv(iov, niov, NULL);
+}
+
+// send a pdu_alloc()ed PDU that others may hold too, such as a reply
+// the at-most-once window keeps. whatever the socket does not take is
+// queued as a reference to b rather than a copy; b must not change
+// while it is shared, so it is sealed (see pdu_seal) beforehand. the
+// caller still drops its own reference.
+bool
+connection::send_shared(char *b, int sz)
+{
+	struct iovec iov;
+	iov.iov_base = b;
+	iov.iov_len = sz;
+	return sendv(&iov, 1, b);
+}
+
+bool
+connection::sendv(const struct iovec *iov, int niov, char *shared)
+{
+	int min = get_compression();
+	if (min <= 0)
+		return enqueue(iov, niov, shared, 0);
+
+	int sz = 0;
+	for (int i = 0; i < niov; i++)
+		sz += iov[i].iov_len;
+	char *packed = NULL;
+	int psz = 0;
+	if (sz >= min && __atomic_load_n(&peer_inflates_, __ATOMIC_RELAXED))
+		packed = pack(iov, niov, sz, &psz);
+	if (!packed)
+		return enqueue(iov, niov, shared, PDU_INFLATES);
+	// the compressed copy goes out like a shared PDU, so whatever
+	// the socket does not take is queued without another copy
+	struct iovec piov;
+	piov.iov_base = packed;
+	piov.iov_len = psz;
+	bool r = enqueue(&piov, 1, packed, PDU_INFLATES | PDU_COMPRESSED);
+	pdu_free(packed);
+	return r;
+}
+
+// the PDU in iov, sz bytes, with its body compressed, in a new
+// pdu_alloc()ed buffer of *psz bytes; NULL if it would not shrink
+// enough. the body is preceded by its uncompressed size.
+char *
+connection::pack(const struct iovec *iov, int niov, int sz, int *psz)
+{
+	VERIFY(iov[0].iov_len >= BODY_OFF);
+	int body = sz - BODY_OFF;
+	// the compressor wants the body in one piece
+	const char *src = (char *)iov[0].iov_base + BODY_OFF;
+	char *tmp = NULL;
+	if (niov > 1) {
+		tmp = pdu_alloc(body);
+		int off = 0;
+		for (int i = 0; i < niov; i++) {
+			int skip = i ? 0 : BODY_OFF;
+			memcpy(tmp + off, (char *)iov[i].iov_base + skip,
+			    iov[i].iov_len - skip);
+			off += iov[i].iov_len - skip;
+		}
+		rpc_count_copy(body);
+		src = tmp;
+	}
+	char *p = pdu_alloc(BODY_OFF + sizeof(int) + rpc_compress_bound(body));
+	memcpy(p, iov[0].iov_base, BODY_OFF);
+	int raw = htonl(body);
+	memcpy(p + BODY_OFF, &raw, sizeof(raw));
+	int n = rpc_compress(src, body, p + BODY_OFF + sizeof(raw));
+	pdu_free(tmp);
+	if (n > body - body / 8) {
+		pdu_free(p);
+		return NULL;
+	}
+	*psz = BODY_OFF + sizeof(raw) + n;
+	return p;
+}
+
+// queue or write a PDU; flags go in its length word
+bool
+connection::enqueue(const struct iovec *iov, int niov, char *shared, int flags)
+{
+	int sz = 0;
+	for (int i = 0; i < niov; i++)
+		sz += iov[i].iov_len;
+	VERIFY(niov > 0 && iov[0].iov_len >= sizeof(int));
+
+	__atomic_add_fetch(&senders_, 1, __ATOMIC_RELAXED);
 	ScopedLock ml(&m_);
+	// senders that got here before us and wait for m_ too
+	int crowd = __atomic_sub_fetch(&senders_, 1, __ATOMIC_RELAXED);
 	waiters_++;
-	while (!dead_ && wpdu_.buf) {
+	while (!dead_ && wq_bytes_ > MAX_QUEUED) {
 		VERIFY(pthread_cond_wait(&send_wait_, &m_)==0);
 	}
 	waiters_--;
 	if (dead_) {
 		return false;
 	}
-	wpdu_.buf = b;
-	wpdu_.sz = sz;
-	wpdu_.solong = 0;
+
+	// the length word goes out from here, not from the caller's
+	// buffer: that may be a shared PDU (see send_shared) that other
+	// connections are still writing out, so it must not change
+	int nsz = htonl(sz | flags);
+	struct iovec v[niov + 1];
+	v[0].iov_base = &nsz;
+	v[0].iov_len = sizeof(nsz);
+	v[1].iov_base = (char *)iov[0].iov_base + sizeof(nsz);
+	v[1].iov_len = iov[0].iov_len - sizeof(nsz);
+	for (int i = 1; i < niov; i++)
+		v[i + 1] = iov[i];
 
 	if (lossy_) {
 		if ((random()%100) < lossy_) {
@@ -143,27 +478,162 @@ connection::send(char *b, int sz)
 		}
 	}
 
-	if (!writepdu()) {
+	// with batching on, a small PDU that finds the queue empty while
+	// other threads are sending too is queued anyway, and its sender
+	// writes the queue out once the batch window has passed; small
+	// PDUs that other threads send meanwhile find the queue busy and
+	// ride along in the same writev. other threads are sending if one
+	// waits for m_ now, or if another thread sent within the window.
+	// a lone sender, pipelining or not, does not wait for company
+	// that will not come.
+	int n = 0;
+	int batch = sz <= BATCH_MAX ? get_batching() : 0;
+	if (batch > 0) {
+		unsigned long long now = now_us();
+		bool company = crowd > 0 ||
+		    (!pthread_equal(last_sender_, pthread_self()) &&
+		     now - last_send_us_ < (unsigned long long)batch);
+		last_sender_ = pthread_self();
+		last_send_us_ = now;
+		if (!company)
+			batch = 0;
+	}
+	if (wq_.empty() && batch <= 0) {
+		// nothing ahead of us: try the socket directly, and only copy
+		// whatever it does not take
+		n = writev(fd_, v, niov + 1);
+		count_syscall(&rpc_write_calls);
+		if (n < 0) {
+			if (errno != EAGAIN) {
+				jsl_log(JSL_DBG_1, "connection::send fd_ %d failure errno=%d\n", fd_, errno);
+				dead_ = true;
+				VERIFY(pthread_mutex_unlock(&m_) == 0);
+				pm_->block_remove_fd(fd_);
+				VERIFY(pthread_mutex_lock(&m_) == 0);
+				return false;
+			}
+			n = 0;
+		}
+		if (n == sz)
+			return true;
+	}
+
+	bool was_empty = wq_.empty();
+	charbuf q;
+	if (shared) {
+		// the unsent part of the length word gets a buffer of its
+		// own, and the rest of the PDU is queued by reference
+		if (n < (int)sizeof(nsz)) {
+			charbuf h(pdu_alloc(sizeof(nsz) - n), sizeof(nsz) - n);
+			memcpy(h.buf, (char *)&nsz + n, h.sz);
+			wq_.push_back(h);
+			wq_bytes_ += h.sz;
+			n = sizeof(nsz);
+		}
+		pdu_hold(shared);
+		q = charbuf(shared, sz);
+		q.solong = n;
+	} else {
+		q = charbuf(pdu_alloc(sz - n), sz - n);
+		int off = 0;
+		for (int i = 0; i < niov + 1; i++) {
+			int len = v[i].iov_len;
+			if (n >= len) {
+				n -= len;
+				continue;
+			}
+			memcpy(q.buf + off, (char *)v[i].iov_base + n, len - n);
+			off += len - n;
+			n = 0;
+		}
+		VERIFY(off == q.sz);
+		rpc_count_copy(q.sz);
+	}
+	bool lead = was_empty && batch > 0;
+	if (was_empty && !lead)
+		pm_->add_callback(fd_, CB_WRONLY, this);
+	wq_.push_back(q);
+	wq_bytes_ += q.sz - q.solong;
+	if (lead)
+		return flush_batch(batch);
+	return true;
+}
+
+//the sender that started a batch: wait out the window without m_,
+//then write whatever has been queued, and leave the rest to the write
+//callback. assumes m_ is held.
+bool
+connection::flush_batch(int us)
+{
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	VERIFY(pthread_mutex_unlock(&m_) == 0);
+	nanosleep(&ts, NULL);
+	VERIFY(pthread_mutex_lock(&m_) == 0);
+	if (dead_)
+		return false;
+	if (!flush()) {
+		jsl_log(JSL_DBG_1, "connection::flush_batch fd_ %d failure\n", fd_);
 		dead_ = true;
+		VERIFY(pthread_cond_broadcast(&send_wait_) == 0);
 		VERIFY(pthread_mutex_unlock(&m_) == 0);
-		PollMgr::Instance()->block_remove_fd(fd_);
+		pm_->block_remove_fd(fd_);
 		VERIFY(pthread_mutex_lock(&m_) == 0);
-	}else{
-		if (wpdu_.solong == wpdu_.sz) {
-		}else{
-			//should be rare to need to explicitly add write callback
-			PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
-			while (!dead_ && wpdu_.solong >= 0 && wpdu_.solong < wpdu_.sz) {
-				VERIFY(pthread_cond_wait(&send_complete_,&m_) == 0);
+		return false;
+	}
+	if (!wq_.empty())
+		pm_->add_callback(fd_, CB_WRONLY, this);
+	if (waiters_ > 0 && wq_bytes_ <= MAX_QUEUED)
+		VERIFY(pthread_cond_broadcast(&send_wait_) == 0);
+	return true;
+}
+
+//write the send queue until it is empty or the socket is full, up to
+//MAX_IOV PDUs per writev. assumes m_ is held. returns false if the
+//connection failed.
+bool
+connection::flush()
+{
+	while (!wq_.empty()) {
+		struct iovec iov[MAX_IOV];
+		int niov = 0;
+		int want = 0;
+		std::list<charbuf>::iterator i;
+		for (i = wq_.begin(); i != wq_.end() && niov < MAX_IOV; i++) {
+			iov[niov].iov_base = i->buf + i->solong;
+			iov[niov].iov_len = i->sz - i->solong;
+			want += iov[niov].iov_len;
+			niov++;
+		}
+
+		int n = writev(fd_, iov, niov);
+		count_syscall(&rpc_write_calls);
+		if (n < 0) {
+			if (errno != EAGAIN) {
+				jsl_log(JSL_DBG_1, "connection::flush fd_ %d failure errno=%d\n", fd_, errno);
+				return false;
 			}
+			return true;
 		}
+
+		wq_bytes_ -= n;
+		int left = n;
+		while (left > 0) {
+			charbuf &q = wq_.front();
+			int qleft = q.sz - q.solong;
+			if (left < qleft) {
+				q.solong += left;
+				break;
+			}
+			left -= qleft;
+			pdu_free(q.buf);
+			wq_.pop_front();
+		}
+		if (n < want)
+			return true; //the socket is full; wait for the next edge
 	}
-	bool ret = (!dead_ && wpdu_.solong == wpdu_.sz);
-	wpdu_.solong = wpdu_.sz = 0;
-	wpdu_.buf = NULL;
-	if (waiters_ > 0)
-		pthread_cond_broadcast(&send_wait_);
-	return ret;
+	return true;
 }
 
 //fd_ is ready to be written
@@ -173,23 +643,20 @@ connection::write_cb(int s)
 	ScopedLock ml(&m_);
 	VERIFY(!dead_);
 	VERIFY(fd_ == s);
-	if (wpdu_.sz == 0) {
-		PollMgr::Instance()->del_callback(fd_,CB_WRONLY);
-		return;
-	}
-	if (!writepdu()) {
-		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
+	if (!flush()) {
+		pm_->del_callback(fd_, CB_RDWR);
 		dead_ = true;
-	}else{
-		VERIFY(wpdu_.solong >= 0);
-		if (wpdu_.solong < wpdu_.sz) {
-			return;
-		}
-	} 
-	pthread_cond_signal(&send_complete_);
+	} else if (wq_.empty()) {
+		pm_->del_callback(fd_,CB_WRONLY);
+	}
+	if (waiters_ > 0 && (dead_ || wq_bytes_ <= MAX_QUEUED))
+		VERIFY(pthread_cond_broadcast(&send_wait_) == 0);
 }
 
-//fd_ is ready to be read
+//fd_ is ready to be read. there is no new event until more data
+//arrives, so read until the socket is drained, or have the reactor
+//call again: after READ_BUDGET reads, or shortly if the chanmgr
+//refuses a PDU (the dispatch pool is full).
 void
 connection::read_cb(int s)
 {
@@ -199,108 +666,177 @@ connection::read_cb(int s)
 		return;
 	}
 
-	bool succ = true;
-	if (!rpdu_.buf || rpdu_.solong < rpdu_.sz) {
-		succ = readpdu();
-	}
-
-	if (!succ) {
-		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
-		dead_ = true;
-		pthread_cond_signal(&send_complete_);
-	}
+	for (int i = 0; i < READ_BUDGET; i++) {
+		//a PDU the chanmgr refused last time goes first
+		if (rpdu_.buf && rpdu_.solong == rpdu_.sz && !deliver()) {
+			pm_->retry_read(fd_, true);
+			return;
+		}
 
-	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
-		if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
-			//chanmgr has successfully consumed the pdu
-			rpdu_.buf = NULL;
-			rpdu_.sz = rpdu_.solong = 0;
+		int r = readpdu();
+		if (r < 0) {
+			pm_->del_callback(fd_,CB_RDWR);
+			dead_ = true;
+			VERIFY(pthread_cond_broadcast(&send_wait_) == 0);
+			return;
+		}
+		if (r == 0) {
+			if (rpdu_.buf && rpdu_.solong == rpdu_.sz)
+				pm_->retry_read(fd_, true);
+			return;
 		}
 	}
+	pm_->retry_read(fd_, false);
 }
 
+//a complete PDU just read into rpdu_: note whether the peer takes
+//compressed PDUs, inflate it if it is compressed, and check its
+//checksum. false if it is damaged.
 bool
-connection::writepdu()
-{
-	VERIFY(wpdu_.solong >= 0);
-	if (wpdu_.solong == wpdu_.sz)
-		return true;
-
-	if (wpdu_.solong == 0) {
-		int sz = htonl(wpdu_.sz);
-		bcopy(&sz,wpdu_.buf,sizeof(sz));
-	}
-	int n = write(fd_, wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
-	if (n < 0) {
-		if (errno != EAGAIN) {
-			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
-			wpdu_.solong = -1;
-			wpdu_.sz = 0;
+connection::unpack()
+{
+	int w;
+	memcpy(&w, rpdu_.buf, sizeof(w));
+	w = ntohl(w);
+	if ((w & PDU_INFLATES) && !peer_inflates_)
+		__atomic_store_n(&peer_inflates_, 1, __ATOMIC_RELAXED);
+	if (w & PDU_COMPRESSED) {
+		int raw;
+		if (rpdu_.sz < (int)(BODY_OFF + sizeof(raw)))
+			return false;
+		memcpy(&raw, rpdu_.buf + BODY_OFF, sizeof(raw));
+		raw = ntohl(raw);
+		if (raw < 0 || raw > MAX_PDU)
+			return false;
+		char *b = pdu_alloc(BODY_OFF + raw);
+		memcpy(b, rpdu_.buf, BODY_OFF);
+		int n = rpc_decompress(rpdu_.buf + BODY_OFF + sizeof(raw),
+		    rpdu_.sz - BODY_OFF - sizeof(raw), b + BODY_OFF, raw);
+		if (n != raw) {
+			jsl_log(JSL_DBG_OFF, "connection::readpdu bad compressed pdu\n");
+			pdu_free(b);
+			return false;
 		}
-		return (errno == EAGAIN);
+		pdu_free(rpdu_.buf);
+		rpdu_.buf = b;
+		rpdu_.sz = rpdu_.solong = BODY_OFF + raw;
 	}
-	wpdu_.solong += n;
+	//the chanmgr sees a plain length word
+	w = htonl(rpdu_.sz);
+	memcpy(rpdu_.buf, &w, sizeof(w));
+#if RPC_CHECKSUMMING
+	return pdu_check(rpdu_.buf, rpdu_.sz);
+#else
 	return true;
+#endif
 }
 
+//hand the complete rpdu_ to the chanmgr. false if it did not take it.
 bool
-connection::readpdu()
+connection::deliver()
 {
-	if (!rpdu_.sz) {
-		int sz, sz1;
-		int n = read(fd_, &sz1, sizeof(sz1));
+	if (!mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz))
+		return false;
+	//chanmgr has successfully consumed the pdu
+	rpdu_.buf = NULL;
+	rpdu_.sz = rpdu_.solong = 0;
+	return true;
+}
 
-		if (n == 0) {
-			return false;
+//one read from the socket, then deliver every complete PDU. returns
+//-1 if the connection failed, 0 if the socket has no more data for
+//now, and 1 if there may be more.
+int
+connection::readpdu()
+{
+	if (rpdu_.buf) {
+		//the rest of a PDU too large for ibuf_
+		int want = rpdu_.sz - rpdu_.solong;
+		int n = read(fd_, rpdu_.buf + rpdu_.solong, want);
+		count_syscall(&rpc_read_calls);
+		if (n == 0)
+			return -1;
+		if (n < 0)
+			return errno == EAGAIN ? 0 : -1;
+		rpdu_.solong += n;
+		if (rpdu_.solong == rpdu_.sz) {
+			if (!unpack())
+				return -1;
+			deliver();
 		}
+		return 1;
+	}
 
-		if (n < 0) {
-			VERIFY(errno!=EAGAIN);
-			return false;
-		}
+	//idle connections hold no input buffer
+	if (!ibuf_)
+		ibuf_ = pdu_alloc(IBUF_SZ);
 
-		if (n >0 && n!= sizeof(sz)) {
-			jsl_log(JSL_DBG_OFF, "connection::readpdu short read of sz\n");
-			return false;
+	int r = 1;
+	if (ilen_ < IBUF_SZ) {
+		int want = IBUF_SZ - ilen_;
+		int n = read(fd_, ibuf_ + ilen_, want);
+		count_syscall(&rpc_read_calls);
+		if (n == 0)
+			return -1;
+		if (n < 0) {
+			if (errno != EAGAIN)
+				return -1;
+			r = 0;
+		} else {
+			//even a short read does not tell that the socket is
+			//drained: a FIN that came with the data has had its
+			//edge, so read on until EAGAIN
+			ilen_ += n;
 		}
+	}
 
-		sz = ntohl(sz1);
+	int off = 0;
+	while (ilen_ - off >= (int)sizeof(int)) {
+		int sz, sz1;
+		bcopy(ibuf_ + off, &sz1, sizeof(sz1));
+		sz = ntohl(sz1) & PDU_SZ_MASK;
 
-		if (sz > MAX_PDU) {
+		if ((ntohl(sz1) & ~(PDU_SZ_MASK | PDU_COMPRESSED | PDU_INFLATES)) ||
+		    sz > MAX_PDU || sz < (int)sizeof(sz)) {
 			char *tmpb = (char *)&sz1;
 			jsl_log(JSL_DBG_2, "connection::readpdu read pdu TOO BIG %d network order=%x %x %x %x %x\n", sz, 
 					sz1, tmpb[0],tmpb[1],tmpb[2],tmpb[3]);
-			return false;
+			return -1;
 		}
 
+		int have = ilen_ - off;
+		if (have < sz && sz <= IBUF_SZ)
+			break; //the rest will fit in ibuf_
+
+		int take = have < sz ? have : sz;
+		rpdu_.buf = pdu_alloc(sz);
 		rpdu_.sz = sz;
-		VERIFY(rpdu_.buf == NULL);
-		rpdu_.buf = (char *)malloc(sz+sizeof(sz));
-		VERIFY(rpdu_.buf);
-		bcopy(&sz1,rpdu_.buf,sizeof(sz));
-		rpdu_.solong = sizeof(sz);
+		rpdu_.solong = take;
+		bcopy(ibuf_ + off, rpdu_.buf, take);
+		rpc_count_copy(take);
+		off += take;
+		if (take < sz)
+			break;
+		if (!unpack())
+			return -1;
+		if (!deliver())
+			break;
 	}
-
-	int n = read(fd_, rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
-	if (n <= 0) {
-		if (errno == EAGAIN)
-			return true;
-		if (rpdu_.buf)
-			free(rpdu_.buf);
-		rpdu_.buf = NULL;
-		rpdu_.sz = rpdu_.solong = 0;
-		return (errno == EAGAIN);
+	if (off > 0) {
+		memmove(ibuf_, ibuf_ + off, ilen_ - off);
+		ilen_ -= off;
 	}
-	rpdu_.solong += n;
-	return true;
+	if (ilen_ == 0) {
+		pdu_free(ibuf_);
+		ibuf_ = NULL;
+	}
+	return r;
 }
 
 tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest) 
-: mgr_(m1), lossy_(lossytest)
+: mgr_(m1), lossy_(lossytest), accepts_(0)
 {
 
-	VERIFY(pthread_mutex_init(&m_,NULL) == 0);
-
 	struct sockaddr_in sin;
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
@@ -314,21 +850,93 @@ tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest)
 
 	int yes = 1;
 	setsockopt(tcp_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-	setsockopt(tcp_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	apply_sockopts(tcp_, true);
 
 	if(bind(tcp_, (sockaddr *)&sin, sizeof(sin)) < 0){
 		perror("accept_loop tcp bind:");
 		VERIFY(0);
 	}
 
-	if(listen(tcp_, 1000) < 0) {
+	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d %d\n", port, 
+		sin.sin_port);
+	start();
+}
+
+// a listener on a unix-domain socket at path, for clients on the same
+// host; NULL (and a log message) if it cannot be set up. the socket's
+// directory is created with mode 0700 if it does not exist, and must
+// belong to this user and be closed to everyone else, so only this
+// user can reach the socket. a stale socket of this user's at path,
+// left by an earlier server, is removed first; anything else there is
+// left alone.
+tcpsconn *
+tcpsconn::unix_listener(chanmgr *m1, const char *path, int lossytest)
+{
+	struct sockaddr_un sun;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		jsl_log(JSL_DBG_OFF, "tcpsconn::unix_listener %s: path too long\n", path);
+		return NULL;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	std::string dir(path);
+	size_t slash = dir.rfind('/');
+	if (slash == std::string::npos)
+		dir = ".";
+	else
+		dir.resize(slash ? slash : 1);
+	struct stat st;
+	if ((mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) ||
+	    lstat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+		jsl_log(JSL_DBG_OFF, "tcpsconn::unix_listener %s: not a private "
+				"directory of this user\n", dir.c_str());
+		return NULL;
+	}
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+			jsl_log(JSL_DBG_OFF, "tcpsconn::unix_listener %s: in use\n", path);
+			return NULL;
+		}
+		unlink(path);
+	}
+
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) {
+		jsl_log(JSL_DBG_OFF, "tcpsconn::unix_listener socket errno %d\n", errno);
+		return NULL;
+	}
+	apply_sockopts(s, false);
+	if (bind(s, (sockaddr *)&sun, sizeof(sun)) < 0) {
+		jsl_log(JSL_DBG_OFF, "tcpsconn::unix_listener %s: bind errno %d\n",
+				path, errno);
+		close(s);
+		return NULL;
+	}
+	chmod(path, 0600);
+
+	jsl_log(JSL_DBG_2, "tcpsconn::unix_listener listen on %s\n", path);
+	return new tcpsconn(m1, s, path, lossytest);
+}
+
+tcpsconn::tcpsconn(chanmgr *m1, int s, const char *path, int lossytest)
+: tcp_(s), mgr_(m1), lossy_(lossytest), accepts_(0), path_(path)
+{
+	start();
+}
+
+void
+tcpsconn::start()
+{
+	VERIFY(pthread_mutex_init(&m_,NULL) == 0);
+
+	if(listen(tcp_, SOMAXCONN) < 0) {
 		perror("tcpsconn::tcpsconn listen:");
 		VERIFY(0);
 	}
 
-	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d %d\n", port, 
-		sin.sin_port);
-
 	if (pipe(pipe_) < 0) {
 		perror("accept_loop pipe:");
 		VERIFY(0);
@@ -345,6 +953,8 @@ tcpsconn::~tcpsconn()
 {
 	VERIFY(close(pipe_[1]) == 0);
 	VERIFY(pthread_join(th_, NULL) == 0);
+	if (!path_.empty())
+		unlink(path_.c_str());
 
 	//close all the active connections
 	std::map<int, connection *>::iterator i;
@@ -357,20 +967,44 @@ tcpsconn::~tcpsconn()
 void
 tcpsconn::process_accept()
 {
-	sockaddr_in sin;
-	socklen_t slen = sizeof(sin);
-	int s1 = accept(tcp_, (sockaddr *)&sin, &slen); 
+	sockaddr_storage ss;
+	socklen_t slen = sizeof(ss);
+	int s1 = accept(tcp_, (sockaddr *)&ss, &slen); 
 	if (s1 < 0) {
+		if (errno == EMFILE || errno == ENFILE) {
+			//out of fds; the client will wait in the backlog
+			jsl_log(JSL_DBG_OFF, "tcpsconn::accept_conn out of fds\n");
+			usleep(10000);
+			return;
+		}
+		if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+			return;
 		perror("tcpsconn::accept_conn error");
 		pthread_exit(NULL);
 	}
 
-	jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", 
-			s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-	connection *ch = new connection(mgr_, s1, lossy_);
+	//accepted sockets inherit the listener's options, but those
+	//may have changed since it was set up
+	apply_sockopts(s1, ss.ss_family == AF_INET);
+	if (ss.ss_family == AF_INET) {
+		sockaddr_in *sin = (sockaddr_in *)&ss;
+		jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", 
+				s1, inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+	} else {
+		jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d on %s\n",
+				s1, path_.c_str());
+	}
+	//spread connections over the reactors, so that reading and
+	//splitting requests is not all on one thread
+	connection *ch = new connection(mgr_, s1, lossy_, PollMgr::Next());
 
-        // garbage collect all dead connections with refcount of 1
+        // garbage collect all dead connections with refcount of 1.
+        // a sweep looks at every connection, so only do it now and then
         std::map<int, connection *>::iterator i;
+        if (++accepts_ % GC_EVERY != 0) {
+                conns_[ch->channo()] = ch;
+                return;
+        }
         for (i = conns_.begin(); i != conns_.end();) {
                 if (i->second->isdead() && i->second->ref() == 1) {
 			jsl_log(JSL_DBG_2, "accept_loop garbage collected fd=%d\n",
@@ -391,32 +1025,33 @@ tcpsconn::process_accept()
 void
 tcpsconn::accept_conn()
 {
-	fd_set rfds;
-	int max_fd = pipe_[0] > tcp_ ? pipe_[0] : tcp_;
+	//poll rather than select: the listening socket may well be
+	//above FD_SETSIZE in a process with many connections
+	struct pollfd pfd[2];
+	pfd[0].fd = pipe_[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = tcp_;
+	pfd[1].events = POLLIN;
 
 	while (1) { 
-		FD_ZERO(&rfds);
-		FD_SET(pipe_[0], &rfds);
-		FD_SET(tcp_, &rfds);
-
-		int ret = select(max_fd+1, &rfds, NULL, NULL, NULL);
+		int ret = poll(pfd, 2, -1);
 
 		if (ret < 0) {
 			if (errno == EINTR) {
 				continue;
 			} else {
-				perror("accept_conn select:");
+				perror("accept_conn poll:");
 				jsl_log(JSL_DBG_OFF, "tcpsconn::accept_conn failure errno %d\n",errno);
 				VERIFY(0);
 	                }
 		}
 
-		if (FD_ISSET(pipe_[0], &rfds)) {
+		if (pfd[0].revents) {
 			close(pipe_[0]);
 			close(tcp_);
 			return;
 		}
-		else if (FD_ISSET(tcp_, &rfds)) {
+		else if (pfd[1].revents) {
 			process_accept();
 		} else {
 			VERIFY(0);
@@ -428,8 +1063,7 @@ connection *
 connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
 {
 	int s= socket(AF_INET, SOCK_STREAM, 0);
-	int yes = 1;
-	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	apply_sockopts(s, true);
 	if(connect(s, (sockaddr*)&dst, sizeof(dst)) < 0) {
 		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s:%d\n", 
 				inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
@@ -441,4 +1075,24 @@ connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
 	return new connection(mgr, s, lossy);
 }
 
+// the same, over a unix-domain socket
+connection *
+connect_to_dst(const char *path, chanmgr *mgr, int lossy)
+{
+	struct sockaddr_un sun;
+	if(strlen(path) >= sizeof(sun.sun_path))
+		return NULL;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
 
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	apply_sockopts(s, false);
+	if(connect(s, (sockaddr*)&sun, sizeof(sun)) < 0) {
+		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s\n", path);
+		close(s);
+		return NULL;
+	}
+	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s\n", s, path);
+	return new connection(mgr, s, lossy);
+}
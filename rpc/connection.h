@@ -5,9 +5,12 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include <cstddef>
 
 #include <map>
+#include <list>
+#include <string>
 
 #include "pollmgr.h"
 
@@ -29,7 +32,8 @@ class connection : public aio_callback {
 			int solong; //amount of bytes written or read so far
 		};
 
-		connection(chanmgr *m1, int f1, int lossytest=0);
+		// pm is the reactor that watches f1; NULL picks the next one
+		connection(chanmgr *m1, int f1, int lossytest=0, PollMgr *pm=NULL);
 		~connection();
 
 		int channo() { return fd_; }
@@ -37,6 +41,8 @@ class connection : public aio_callback {
 		void closeconn();
 
 		bool send(char *b, int sz);
+		bool send(const struct iovec *iov, int niov);
+		bool send_shared(char *b, int sz);
 		void write_cb(int s);
 		void read_cb(int s);
 
@@ -47,15 +53,46 @@ class connection : public aio_callback {
                 int compare(connection *another);
 	private:
 
-		bool readpdu();
-		bool writepdu();
+		bool sendv(const struct iovec *iov, int niov, char *shared);
+		bool enqueue(const struct iovec *iov, int niov, char *shared,
+				int flags);
+		char *pack(const struct iovec *iov, int niov, int sz, int *psz);
+		bool unpack();
+		int readpdu();
+		bool deliver();
+		bool flush();
+		bool flush_batch(int us);
 
 		chanmgr *mgr_;
+		PollMgr *pm_;
 		const int fd_;
 		bool dead_;
 
-		charbuf wpdu_;
+		// PDUs, or their unsent tails, that the socket did not take
+		// right away, in order. the buffers are pdu_alloc()ed, either
+		// our own copies or references to shared PDUs; the PollMgr
+		// write callback is armed while the queue is not empty.
+		std::list<charbuf> wq_;
+		int wq_bytes_;
+
+		// send batching (see set_batching): threads in enqueue, and
+		// which thread last sent a small PDU, and when (us)
+		int senders_;
+		pthread_t last_sender_;
+		unsigned long long last_send_us_;
+
+		// input is read in chunks into ibuf_, so several small PDUs
+		// cost one read; each is then copied out into its own buffer.
+		// ibuf_ is only allocated while there is input to read.
+		// rpdu_ is a PDU the chanmgr has not taken yet: a large one
+		// still being read straight from the socket, or a complete
+		// one got_pdu refused.
+		char *ibuf_;
+		int ilen_;
 		charbuf rpdu_;
+
+		// the peer said (in a length word) it takes compressed PDUs
+		int peer_inflates_;
                 
                 struct timeval create_time_;
 
@@ -65,17 +102,19 @@ class connection : public aio_callback {
 
 		pthread_mutex_t m_;
 		pthread_mutex_t ref_m_;
-		pthread_cond_t send_complete_;
-		pthread_cond_t send_wait_;
+		pthread_cond_t send_wait_; // wq_bytes_ dropped below the limit
 };
 
 class tcpsconn {
 	public:
 		tcpsconn(chanmgr *m1, int port, int lossytest=0);
 		~tcpsconn();
+		static tcpsconn *unix_listener(chanmgr *m1, const char *path,
+				int lossytest=0);
 
 		void accept_conn();
 	private:
+		tcpsconn(chanmgr *m1, int s, const char *path, int lossytest);
 
 		pthread_mutex_t m_;
 		pthread_t th_;
@@ -85,7 +124,10 @@ class tcpsconn {
 		chanmgr *mgr_;
 		int lossy_;
 		std::map<int, connection *> conns_;
+		unsigned int accepts_;
+		std::string path_; //unix-domain socket, unlinked when done
 
+		void start();
 		void process_accept();
 };
 
@@ -96,6 +138,55 @@ struct bundle {
 	int lossy;
 };
 
+// with RPC_CHECKSUMMING, every PDU carries a CRC-32C of what follows
+// its length word and checksum slot. send() and send(iov) fill it in;
+// a buffer handed to send_shared() must be sealed with pdu_seal()
+// before it is shared. a PDU that arrives with a bad checksum kills
+// the connection, as a read error would. without RPC_CHECKSUMMING
+// pdu_seal() does nothing.
+void pdu_seal(char *b, int sz);
+
+// PDU compression. a process with compression on marks the length
+// word of every PDU it sends to say it takes compressed PDUs, and
+// compresses PDUs of at least min bytes (their body, past the length
+// word and checksum) for peers that said the same. a PDU that would
+// not shrink by at least an eighth goes out as it is. min is 0 (off)
+// by default, or $RPC_COMPRESS. compressed PDUs are always accepted.
+void set_compression(int min);
+int get_compression();
+
+// send batching. with a window of us microseconds, a thread sending a
+// PDU of up to 4KB to an idle connection that other threads are
+// sending to as well holds it back that long, and the small PDUs the
+// others send meanwhile go out with it in one writev; the peer reads
+// them back in one go. replies are sent the same way. this trades up
+// to us of latency for fewer syscalls when many threads talk to one
+// peer; a lone sender is not held back. 0 (off) by default, or
+// $RPC_BATCH_US; applies to PDUs sent afterwards.
+void set_batching(int us);
+int get_batching();
+
+// read and writev calls on rpc connections, for benchmarks; updated
+// without ordering
+extern unsigned long long rpc_write_calls;
+extern unsigned long long rpc_read_calls;
+
+// options set on every rpc socket. the defaults come from
+// $RPC_NODELAY (default 1), $RPC_SNDBUF and $RPC_RCVBUF (bytes, 0
+// leaves the kernel's autotuning alone) and $RPC_BUSY_POLL (us the
+// kernel may busy-wait for data on a blocking read, 0 for off; Linux
+// only, and raising it may need CAP_NET_ADMIN). set_sockopts applies
+// to sockets created afterwards.
+struct sockopts {
+	bool nodelay;
+	int sndbuf;
+	int rcvbuf;
+	int busy_poll;
+};
+sockopts get_sockopts();
+void set_sockopts(const sockopts &o);
+
 void start_accept_thread(chanmgr *mgr, int port, pthread_t *th, int *fd = NULL, int lossy=0);
 connection *connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy=0);
+connection *connect_to_dst(const char *path, chanmgr *mgr, int lossy=0);
 #endif
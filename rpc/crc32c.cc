@@ -0,0 +1,141 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define POLY 0x82f63b78 //reversed Castagnoli polynomial
+#define STREAM 512 //bytes per stream when three run side by side
+
+// table[k][b]: the CRC of byte b followed by k zero bytes
+static uint32_t table[8][256];
+// shift[k][b]: a CRC register holding b << 8k, after STREAM zero bytes
+static uint32_t shift[4][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static bool use_hw;
+
+static void
+crc32c_init()
+{
+	for (int b = 0; b < 256; b++) {
+		uint32_t c = b;
+		for (int i = 0; i < 8; i++)
+			c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+		table[0][b] = c;
+	}
+	for (int b = 0; b < 256; b++)
+		for (int k = 1; k < 8; k++)
+			table[k][b] = (table[k - 1][b] >> 8) ^
+			    table[0][table[k - 1][b] & 0xff];
+	// feeding zeros is linear in the register, so shifting each
+	// of its 32 bits is enough to fill the shift tables
+	uint32_t bit[32];
+	for (int i = 0; i < 32; i++) {
+		uint32_t c = 1u << i;
+		for (int n = 0; n < STREAM; n++)
+			c = table[0][c & 0xff] ^ (c >> 8);
+		bit[i] = c;
+	}
+	for (int k = 0; k < 4; k++) {
+		for (int b = 0; b < 256; b++) {
+			uint32_t c = 0;
+			for (int i = 0; i < 8; i++)
+				if (b & (1 << i))
+					c ^= bit[8 * k + i];
+			shift[k][b] = c;
+		}
+	}
+#ifdef CRC32C_X86
+	use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// the register c after STREAM more zero bytes
+static inline uint32_t
+shift_stream(uint32_t c)
+{
+	return shift[0][c & 0xff] ^ shift[1][(c >> 8) & 0xff] ^
+	    shift[2][(c >> 16) & 0xff] ^ shift[3][c >> 24];
+}
+
+uint32_t
+crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&table_once, crc32c_init);
+	const unsigned char *p = (const unsigned char *)buf;
+	crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; len > 0 && ((uintptr_t)p & 7); len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		w ^= crc; //little-endian: the crc lines up with the first 4 bytes
+		crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+		    table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+		    table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+		    table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+	}
+#endif
+	for (; len > 0; len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_x86(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	uint64_t c = ~crc;
+	for (; len > 0 && ((uintptr_t)p & 7); len--)
+		c = _mm_crc32_u8(c, *p++);
+	// a crc32 takes 3 cycles but a new one can start every cycle,
+	// so long buffers are done as three streams side by side; the
+	// registers of the first two are then shifted past the rest
+	// and folded in
+	for (; len >= 3 * STREAM; len -= 3 * STREAM, p += 3 * STREAM) {
+		uint64_t c1 = 0, c2 = 0;
+		for (int i = 0; i < STREAM; i += 8) {
+			uint64_t w0, w1, w2;
+			memcpy(&w0, p + i, 8);
+			memcpy(&w1, p + STREAM + i, 8);
+			memcpy(&w2, p + 2 * STREAM + i, 8);
+			c = _mm_crc32_u64(c, w0);
+			c1 = _mm_crc32_u64(c1, w1);
+			c2 = _mm_crc32_u64(c2, w2);
+		}
+		c = shift_stream(shift_stream(c) ^ c1) ^ c2;
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	for (; len > 0; len--)
+		c = _mm_crc32_u8(c, *p++);
+	return ~(uint32_t)c;
+}
+#endif
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&table_once, crc32c_init);
+#ifdef CRC32C_X86
+	if (use_hw)
+		return crc32c_x86(crc, buf, len);
+#endif
+	return crc32c_sw(crc, buf, len);
+}
+
+bool
+crc32c_hw()
+{
+	pthread_once(&table_once, crc32c_init);
+	return use_hw;
+}
@@ -0,0 +1,22 @@
+#ifndef crc32c_h
+#define crc32c_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), the checksum of iSCSI and ext4. On x86-64
+// CPUs with SSE4.2 it runs on the crc32 instruction, 8 bytes at a
+// time and three streams at once for long buffers; elsewhere it uses
+// tables, 8 bytes at a time as well ("slicing-by-8").
+//
+// crc32c(0, buf, len) checksums buf; to checksum data in pieces,
+// pass the result for the previous piece as crc.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// the same without the crc32 instruction, for tests and benchmarks
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+// true if crc32c() uses the crc32 instruction
+bool crc32c_hw();
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef futex_h
+#define futex_h
+
+// sleep until *addr is woken, if it still holds val, or for at most
+// ms milliseconds if ms >= 0 (then returns false on timeout); and wake
+// up to n threads sleeping on addr. wakeups may be spurious, so callers
+// re-check their condition in a loop.
+
+#ifdef __linux__
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+inline bool
+futex_wait(int *addr, int val, int ms = -1)
+{
+	struct timespec ts, *tsp = NULL;
+	if (ms >= 0) {
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000;
+		tsp = &ts;
+	}
+	return !(syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0) < 0
+		 && errno == ETIMEDOUT);
+}
+
+inline void
+futex_wake(int *addr, int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#else
+// no futexes: all waiters share one mutex and condition variable
+#include <pthread.h>
+#include <errno.h>
+#include "gettime.h"
+
+extern pthread_mutex_t futex_emul_m;
+extern pthread_cond_t futex_emul_c;
+
+inline bool
+futex_wait(int *addr, int val, int ms = -1)
+{
+	int r = 0;
+	pthread_mutex_lock(&futex_emul_m);
+	if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) {
+		if (ms < 0) {
+			pthread_cond_wait(&futex_emul_c, &futex_emul_m);
+		} else {
+			struct timespec now, deadline;
+			clock_gettime(CLOCK_REALTIME, &now);
+			deadline.tv_sec = now.tv_sec + ms / 1000;
+			deadline.tv_nsec = now.tv_nsec + (ms % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			r = pthread_cond_timedwait(&futex_emul_c, &futex_emul_m, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&futex_emul_m);
+	return r != ETIMEDOUT;
+}
+
+inline void
+futex_wake(int *addr, int n)
+{
+	pthread_mutex_lock(&futex_emul_m);
+	pthread_cond_broadcast(&futex_emul_c);
+	pthread_mutex_unlock(&futex_emul_m);
+}
+#endif
+
+#endif
@@ -10,8 +10,10 @@
 #include <string.h>
 #include <cstddef>
 #include <inttypes.h>
+#include <sys/uio.h>
 #include "lang/verify.h"
 #include "lang/algorithm.h"
+#include "pdu_pool.h"
 
 struct req_header {
 	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
@@ -29,12 +31,36 @@ struct reply_header {
 	int ret;
 };
 
+// bytes the RPC library has copied from one buffer to another
+// (marshalling, unmarshalling strings, queueing, reply caching).
+// for benchmarks; updated without ordering.
+extern unsigned long long rpc_bytes_copied;
+
+inline void
+rpc_count_copy(unsigned long long n)
+{
+	__atomic_add_fetch(&rpc_bytes_copied, n, __ATOMIC_RELAXED);
+}
+
+// a string argument a handler receives without copying it out of
+// the request: it points into the request buffer and is valid only
+// until the handler returns. on the wire it is just a std::string.
+struct rpc_view {
+	rpc_view(): data(NULL), size(0) {}
+	const char *data;
+	unsigned int size;
+	std::string str() const { return std::string(data, size); }
+};
+
 typedef uint64_t rpc_checksum_t;
 typedef int rpc_sz_t;
 
 enum {
-	//size of initial buffer allocation 
-	DEFAULT_RPC_SZ = 1024,
+	//bytes a marshall holds inline, before it needs a buffer
+	INLINE_RPC_SZ = 256,
+	//strings at least this long are sent from the caller's memory
+	//by marshalls that borrow (see below)
+	BORROW_MIN_SZ = 4096,
 #if RPC_CHECKSUMMING
 	//size of rpc_header includes a 4-byte int to be filled by tcpchan and uint64_t checksum
 	RPC_HEADER_SZ = static_max<sizeof(req_header), sizeof(reply_header)>::value + sizeof(rpc_sz_t) + sizeof(rpc_checksum_t)
@@ -43,33 +69,76 @@ enum {
 #endif
 };
 
+// A marshall that borrows does not copy large strings into its buffer
+// but keeps a pointer to them, and the PDU goes out as a list of
+// segments (see iov()). The strings must then stay alive and unchanged
+// as long as the marshall is used, so only rpcc, whose callers block
+// (or whose futures flatten() after the first send), borrows.
+//
+// A marshall starts out in INLINE_RPC_SZ bytes of its own, so a small
+// PDU needs no buffer allocation until take_buf() (or never, if it is
+// only sent). A caller that knows how large the content will be (see
+// wire_size, or copied_size for a marshall that borrows) passes it as
+// the hint, and the first buffer allocated is then large enough for
+// all of it.
 class marshall {
 	private:
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
 		int _capa;      // Capacity of the buffer
 		int _ind;       // Read/write head position
+		int _hint;      // expected bytes of content, 0 if unknown
+		char _inline[INLINE_RPC_SZ];
+
+		// borrowed bytes that come right after _buf[0.._at)
+		struct segment {
+			int at;
+			const char *p;
+			int n;
+		};
+		bool _borrow;
+		std::vector<segment> _segs;
+		int _segsz;     // total bytes in _segs
+
+		void grow(int n);
+		bool isinline() { return _buf == _inline; }
+
+		// not copyable: _buf may point into the object
+		marshall(const marshall &);
+		marshall &operator=(const marshall &);
 
 	public:
-		marshall() {
-			_buf = (char *) malloc(sizeof(char)*DEFAULT_RPC_SZ);
-			VERIFY(_buf);
-			_capa = DEFAULT_RPC_SZ;
-			_ind = RPC_HEADER_SZ;
+		marshall(bool borrow = false, int hint = 0)
+			: _buf(_inline), _capa(INLINE_RPC_SZ), _ind(RPC_HEADER_SZ),
+			_hint(hint), _borrow(borrow), _segsz(0) {
 		}
 
 		~marshall() { 
-			if (_buf) 
-				free(_buf); 
+			if (_buf && !isinline())
+				pdu_free(_buf); 
 		}
 
-		int size() { return _ind;}
-		char *cstr() { return _buf;}
+		// the content will be about n more bytes
+		void expect(int n) { _hint = _ind - RPC_HEADER_SZ + n; }
+
+		int size() { return _ind + _segsz;}
+		char *cstr() { flatten(); return _buf;}
 
 		void rawbyte(unsigned char);
 		void rawbytes(const char *, int);
+		// like rawbytes, but may borrow p instead of copying it
+		void refbytes(const char *, int);
+
+		// copy the borrowed bytes in; afterwards the marshall
+		// no longer refers to memory it does not own
+		void flatten();
+		bool borrowed() { return !_segs.empty(); }
+		// the PDU as a list of segments, the first one being
+		// at least the header
+		void iov(std::vector<struct iovec> *v);
 
 		// Return the current content (excluding header) as a string
 		std::string get_content() { 
+			flatten();
 			return std::string(_buf+RPC_HEADER_SZ,_ind-RPC_HEADER_SZ);
 		}
 
@@ -107,8 +176,17 @@ class marshall {
 			_ind = saved_sz;
 		}
 
+		// the PDU in a pdu_alloc()ed buffer, which the caller
+		// now owns
 		void take_buf(char **b, int *s) {
-			*b = _buf;
+			flatten();
+			if (isinline()) {
+				*b = pdu_alloc(_ind);
+				memcpy(*b, _buf, _ind);
+				rpc_count_copy(_ind);
+			} else {
+				*b = _buf;
+			}
 			*s = _ind;
 			_buf = NULL;
 			_ind = 0;
@@ -125,6 +203,35 @@ marshall& operator<<(marshall &, short);
 marshall& operator<<(marshall &, unsigned long long);
 marshall& operator<<(marshall &, const std::string &);
 
+// wire_size(x): the bytes operator<< puts on the wire for x. every
+// marshalled type needs an overload next to its operator<<; this one
+// only turns a missing overload (or one reached by conversion) into a
+// compile error.
+template<class T> inline int wire_size(const T &)
+{
+	static_assert(sizeof(T) == 0, "no wire_size overload for this type");
+	return 0;
+}
+inline int wire_size(bool) { return 1; }
+inline int wire_size(char) { return 1; }
+inline int wire_size(unsigned char) { return 1; }
+inline int wire_size(short) { return 2; }
+inline int wire_size(unsigned short) { return 2; }
+inline int wire_size(int) { return 4; }
+inline int wire_size(unsigned int) { return 4; }
+inline int wire_size(unsigned long long) { return 8; }
+inline int wire_size(const std::string &s) { return 4 + s.size(); }
+
+// copied_size(x): the part of wire_size(x) that a borrowing marshall
+// copies into its own buffer, i.e. without the strings it borrows; it
+// is the hint for such a marshall. types that hold no strings of their
+// own copy all of their wire_size.
+template<class T> inline int copied_size(const T &x) { return wire_size(x); }
+inline int copied_size(const std::string &s)
+{
+	return s.size() < BORROW_MIN_SZ ? wire_size(s) : 4;
+}
+
 class unmarshall {
 	private:
 		char *_buf;
@@ -140,7 +247,7 @@ class unmarshall {
 			take_content(s);
 		}
 		~unmarshall() {
-			if (_buf) free(_buf);
+			if (_buf) pdu_free(_buf);
 		}
 
 		//take contents from another unmarshall object
@@ -149,10 +256,11 @@ class unmarshall {
 		//take the content which does not exclude a RPC header from a string
 		void take_content(const std::string &s) {
 			_sz = s.size()+RPC_HEADER_SZ;
-			_buf = (char *)realloc(_buf,_sz);
+			_buf = pdu_realloc(_buf,_sz);
 			VERIFY(_buf);
 			_ind = RPC_HEADER_SZ;
 			memcpy(_buf+_ind, s.data(), s.size());
+			rpc_count_copy(s.size());
 			_ok = true;
 		}
 
@@ -161,6 +269,7 @@ class unmarshall {
 		bool okdone();
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
+		void rawbytes(rpc_view &v, unsigned int n);
 
 		int ind() { return _ind;}
 		int size() { return _sz;}
@@ -207,9 +316,48 @@ unmarshall& operator>>(unmarshall &, unsigned int &);
 unmarshall& operator>>(unmarshall &, int &);
 unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
+unmarshall& operator>>(unmarshall &, rpc_view &);
+
+template <class C> inline int
+wire_size(const std::vector<C> &v)
+{
+	int n = 4;
+	for(unsigned i = 0; i < v.size(); i++)
+		n += wire_size(v[i]);
+	return n;
+}
+
+template <class A, class B> inline int
+wire_size(const std::map<A,B> &d)
+{
+	int n = 4;
+	typename std::map<A,B>::const_iterator i;
+	for (i = d.begin(); i != d.end(); i++)
+		n += wire_size(i->first) + wire_size(i->second);
+	return n;
+}
+
+template <class C> inline int
+copied_size(const std::vector<C> &v)
+{
+	int n = 4;
+	for(unsigned i = 0; i < v.size(); i++)
+		n += copied_size(v[i]);
+	return n;
+}
+
+template <class A, class B> inline int
+copied_size(const std::map<A,B> &d)
+{
+	int n = 4;
+	typename std::map<A,B>::const_iterator i;
+	for (i = d.begin(); i != d.end(); i++)
+		n += copied_size(i->first) + copied_size(i->second);
+	return n;
+}
 
 template <class C> marshall &
-operator<<(marshall &m, std::vector<C> v)
+operator<<(marshall &m, const std::vector<C> &v)
 {
 	m << (unsigned int) v.size();
 	for(unsigned i = 0; i < v.size(); i++)
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "slock.h"
+#include "pdu_pool.h"
+#include "lang/verify.h"
+
+#define PDU_CLASSES 5
+#define PDU_CACHE_MAX 32 //free buffers a thread keeps per class
+#define PDU_GLOBAL_MAX 1024 //free buffers the global list keeps per class
+#define PDU_REFILL 8 //buffers a thread takes from the global list at once
+
+static const int class_sz[PDU_CLASSES] = { 256, 1024, 4096, 16384, 65536 };
+
+// sits in front of every buffer
+struct pdu_hdr {
+	int cls; //size class, or -1 if the buffer is not pooled
+	int cap; //usable bytes after the header
+	int refs; //owners of the buffer, while it is allocated
+	pdu_hdr *next; //while on a free list
+};
+
+struct pdu_cache {
+	pdu_hdr *free[PDU_CLASSES];
+	int n[PDU_CLASSES];
+};
+
+static pthread_mutex_t global_m = PTHREAD_MUTEX_INITIALIZER;
+static pdu_hdr *global_free[PDU_CLASSES];
+static int global_n[PDU_CLASSES];
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread pdu_cache *cache;
+
+// a thread is exiting: give its buffers to the global list
+static void
+cache_destroy(void *x)
+{
+	pdu_cache *c = (pdu_cache *)x;
+	ScopedLock ml(&global_m);
+	for (int i = 0; i < PDU_CLASSES; i++) {
+		while (c->free[i]) {
+			pdu_hdr *h = c->free[i];
+			c->free[i] = h->next;
+			if (global_n[i] < PDU_GLOBAL_MAX) {
+				h->next = global_free[i];
+				global_free[i] = h;
+				global_n[i]++;
+			} else {
+				free(h);
+			}
+		}
+	}
+	delete c;
+}
+
+static void
+key_init()
+{
+	VERIFY(pthread_key_create(&cache_key, cache_destroy) == 0);
+}
+
+static pdu_cache *
+my_cache()
+{
+	if (!cache) {
+		pthread_once(&key_once, key_init);
+		cache = new pdu_cache();
+		VERIFY(pthread_setspecific(cache_key, cache) == 0);
+	}
+	return cache;
+}
+
+static int
+class_of(int sz)
+{
+	for (int i = 0; i < PDU_CLASSES; i++) {
+		if (sz <= class_sz[i])
+			return i;
+	}
+	return -1;
+}
+
+char *
+pdu_alloc(int sz)
+{
+	int cls = class_of(sz);
+	pdu_hdr *h;
+	if (cls < 0) {
+		h = (pdu_hdr *)malloc(sizeof(pdu_hdr) + sz);
+		VERIFY(h);
+		h->cls = -1;
+		h->cap = sz;
+		h->refs = 1;
+		return (char *)(h + 1);
+	}
+
+	pdu_cache *c = my_cache();
+	if (!c->free[cls]) {
+		ScopedLock ml(&global_m);
+		for (int k = 0; k < PDU_REFILL && global_free[cls]; k++) {
+			h = global_free[cls];
+			global_free[cls] = h->next;
+			global_n[cls]--;
+			h->next = c->free[cls];
+			c->free[cls] = h;
+			c->n[cls]++;
+		}
+	}
+	if (c->free[cls]) {
+		h = c->free[cls];
+		c->free[cls] = h->next;
+		c->n[cls]--;
+	} else {
+		h = (pdu_hdr *)malloc(sizeof(pdu_hdr) + class_sz[cls]);
+		VERIFY(h);
+		h->cls = cls;
+		h->cap = class_sz[cls];
+	}
+	h->refs = 1;
+	return (char *)(h + 1);
+}
+
+char *
+pdu_realloc(char *b, int sz)
+{
+	if (!b)
+		return pdu_alloc(sz);
+	pdu_hdr *h = (pdu_hdr *)b - 1;
+	VERIFY(h->refs == 1);
+	if (sz <= h->cap)
+		return b;
+	char *nb = pdu_alloc(sz);
+	memcpy(nb, b, h->cap);
+	pdu_free(b);
+	return nb;
+}
+
+void
+pdu_hold(char *b)
+{
+	pdu_hdr *h = (pdu_hdr *)b - 1;
+	__atomic_add_fetch(&h->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+pdu_free(char *b)
+{
+	if (!b)
+		return;
+	pdu_hdr *h = (pdu_hdr *)b - 1;
+	//a sole owner needs no atomic decrement; nobody else can hold it
+	if (__atomic_load_n(&h->refs, __ATOMIC_ACQUIRE) != 1 &&
+	    __atomic_sub_fetch(&h->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	int cls = h->cls;
+	if (cls < 0) {
+		free(h);
+		return;
+	}
+
+	pdu_cache *c = my_cache();
+	if (c->n[cls] < PDU_CACHE_MAX) {
+		h->next = c->free[cls];
+		c->free[cls] = h;
+		c->n[cls]++;
+		return;
+	}
+	{
+		ScopedLock ml(&global_m);
+		if (global_n[cls] < PDU_GLOBAL_MAX) {
+			h->next = global_free[cls];
+			global_free[cls] = h;
+			global_n[cls]++;
+			return;
+		}
+	}
+	free(h);
+}
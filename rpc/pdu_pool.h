@@ -0,0 +1,28 @@
+#ifndef pdu_pool_h
+#define pdu_pool_h
+
+// Buffers for PDUs.
+//
+// Every request and reply goes through a buffer that one thread
+// allocates (the PollMgr thread reading it, or the thread marshalling
+// it) and usually another one frees. pdu_alloc() rounds small sizes up
+// to a few size classes and serves them from a per-thread cache of
+// free buffers, so the common small RPC does not touch malloc. A
+// thread whose cache of a class is full hands the buffer to a global
+// list, which the caches of the allocating threads refill from.
+//
+// A buffer from pdu_alloc() must be released with pdu_free(), never
+// free(), and resized with pdu_realloc().
+//
+// Buffers are reference counted, so a PDU can be read by several
+// owners without copying it (a cached reply that also sits in a send
+// queue): pdu_hold() adds a reference, and pdu_free() drops one and
+// only frees the buffer with the last. A shared buffer must not be
+// written to or resized.
+
+char *pdu_alloc(int sz);
+char *pdu_realloc(char *b, int sz);
+void pdu_hold(char *b);
+void pdu_free(char *b);
+
+#endif
@@ -2,6 +2,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "slock.h"
 #include "jsl_log.h"
@@ -9,27 +14,63 @@
 #include "lang/verify.h"
 #include "pollmgr.h"
 
-PollMgr *PollMgr::instance = NULL;
+#define MAX_REACTORS 64
+
+PollMgr **PollMgr::reactors = NULL;
+int PollMgr::nreactors = 0;
+unsigned int PollMgr::next = 0;
 static pthread_once_t pollmgr_is_initialized = PTHREAD_ONCE_INIT;
 
 void
 PollMgrInit()
 {
-	PollMgr::instance = new PollMgr();
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+	char *env = getenv("RPC_REACTORS");
+	if (env != NULL)
+		n = atoi(env);
+	if (n < 1)
+		n = 1;
+	if (n > MAX_REACTORS)
+		n = MAX_REACTORS;
+	int batch = DEFAULT_POLL_BATCH;
+	env = getenv("RPC_EPOLL_BATCH");
+	if (env != NULL && atoi(env) > 0)
+		batch = atoi(env);
+	PollMgr::reactors = new PollMgr *[n];
+	for (int i = 0; i < n; i++)
+		PollMgr::reactors[i] = new PollMgr(batch);
+	PollMgr::nreactors = n;
 }
 
 PollMgr *
 PollMgr::Instance()
 {
 	pthread_once(&pollmgr_is_initialized, PollMgrInit);
-	return instance;
+	return reactors[0];
 }
 
-PollMgr::PollMgr() : pending_change_(false)
+PollMgr *
+PollMgr::Next()
 {
-	bzero(callbacks_, MAX_POLL_FDS*sizeof(void *));
+	pthread_once(&pollmgr_is_initialized, PollMgrInit);
+	unsigned int i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+	return reactors[i % nreactors];
+}
+
+int
+PollMgr::Count()
+{
+	pthread_once(&pollmgr_is_initialized, PollMgrInit);
+	return nreactors;
+}
+
+PollMgr::PollMgr(int batch) : pending_change_(false)
+{
+#ifdef __linux__
+	aio_ = new EPollAIO(batch);
+#else
 	aio_ = new SelectAIO();
-	//aio_ = new EPollAIO();
+#endif
 
 	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
 	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
@@ -45,13 +86,14 @@ PollMgr::~PollMgr()
 void
 PollMgr::add_callback(int fd, poll_flag flag, aio_callback *ch)
 {
-	VERIFY(fd < MAX_POLL_FDS);
-
 	ScopedLock ml(&m_);
-	aio_->watch_fd(fd, flag);
+	aio_callback *old = callbacks_.get(fd);
+	VERIFY(!old || old==ch);
+	//publish ch first: an edge-triggered event that comes in before
+	//the callback is there is lost for good
+	callbacks_.set(fd, ch);
 
-	VERIFY(!callbacks_[fd] || callbacks_[fd]==ch);
-	callbacks_[fd] = ch;
+	aio_->watch_fd(fd, flag);
 }
 
 //remove all callbacks related to fd
@@ -62,9 +104,12 @@ PollMgr::block_remove_fd(int fd)
 {
 	ScopedLock ml(&m_);
 	aio_->unwatch_fd(fd, CB_RDWR);
+	retry_.erase(std::remove(retry_.begin(), retry_.end(), fd), retry_.end());
+	retry_later_.erase(std::remove(retry_later_.begin(), retry_later_.end(), fd),
+			retry_later_.end());
 	pending_change_ = true;
 	VERIFY(pthread_cond_wait(&changedone_c_, &m_)==0);
-	callbacks_[fd] = NULL;
+	callbacks_.set(fd, NULL);
 }
 
 void
@@ -72,15 +117,25 @@ PollMgr::del_callback(int fd, poll_flag flag)
 {
 	ScopedLock ml(&m_);
 	if (aio_->unwatch_fd(fd, flag)) {
-		callbacks_[fd] = NULL;
+		callbacks_.set(fd, NULL);
 	}
 }
 
+void
+PollMgr::retry_read(int fd, bool later)
+{
+	ScopedLock ml(&m_);
+	if (later)
+		retry_later_.push_back(fd);
+	else
+		retry_.push_back(fd);
+}
+
 bool
 PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
 {
 	ScopedLock ml(&m_);
-	if (!callbacks_[fd] || callbacks_[fd]!=c)
+	if (callbacks_.get(fd) != c)
 		return false;
 
 	return aio_->is_watched(fd, flag);
@@ -92,18 +147,32 @@ PollMgr::wait_loop()
 
 	std::vector<int> readable;
 	std::vector<int> writable;
+	std::vector<int> retry;
+	bool later = false;
 
 	while (1) {
+		readable.clear();
+		writable.clear();
+		retry.clear();
 		{
 			ScopedLock ml(&m_);
 			if (pending_change_) {
 				pending_change_ = false;
 				VERIFY(pthread_cond_broadcast(&changedone_c_)==0);
 			}
+			retry.swap(retry_);
+			//fds waiting for room in the dispatch pool get one
+			//round's pause, so we do not spin on them
+			if (later) {
+				retry.insert(retry.end(), retry_later_.begin(),
+						retry_later_.end());
+				retry_later_.clear();
+			}
+			later = !retry_later_.empty();
 		}
-		readable.clear();
-		writable.clear();
-		aio_->wait_ready(&readable,&writable);
+		aio_->wait_ready(&readable,&writable,
+				!retry.empty() ? 0 : (later ? 1 : -1));
+		readable.insert(readable.end(), retry.begin(), retry.end());
 
 		if (!readable.size() && !writable.size()) {
 			continue;
@@ -113,14 +182,16 @@ PollMgr::wait_loop()
 		//modify callbacks_[fd] while the fd is not dead
 		for (unsigned int i = 0; i < readable.size(); i++) {
 			int fd = readable[i];
-			if (callbacks_[fd])
-				callbacks_[fd]->read_cb(fd);
+			aio_callback *cb = callbacks_.get(fd);
+			if (cb)
+				cb->read_cb(fd);
 		}
 
 		for (unsigned int i = 0; i < writable.size(); i++) {
 			int fd = writable[i];
-			if (callbacks_[fd])
-				callbacks_[fd]->write_cb(fd);
+			aio_callback *cb = callbacks_.get(fd);
+			if (cb)
+				cb->write_cb(fd);
 		}
 	}
 }
@@ -149,6 +220,7 @@ SelectAIO::~SelectAIO()
 void
 SelectAIO::watch_fd(int fd, poll_flag flag)
 {
+	VERIFY(fd < FD_SETSIZE);
 	ScopedLock ml(&m_);
 	if (highfds_ <= fd) 
 		highfds_ = fd;
@@ -215,7 +287,8 @@ SelectAIO::unwatch_fd(int fd, poll_flag flag)
 }
 
 void
-SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
+SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+		int timeout_ms)
 {
 	fd_set trfds, twfds;
 	int high;
@@ -228,7 +301,13 @@ SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 
 	}
 
-	int ret = select(high+1, &trfds, &twfds, NULL, NULL);
+	struct timeval tv, *tvp = NULL;
+	if (timeout_ms >= 0) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		tvp = &tv;
+	}
+	int ret = select(high+1, &trfds, &twfds, NULL, tvp);
 
 	if (ret < 0) {
 		if (errno == EINTR) {
@@ -258,15 +337,22 @@ SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 
 #ifdef __linux__ 
 
-EPollAIO::EPollAIO()
+EPollAIO::EPollAIO(int batch) : ready_(batch)
 {
-	pollfd_ = epoll_create(MAX_POLL_FDS);
+	pollfd_ = epoll_create(batch);
 	VERIFY(pollfd_ >= 0);
-	bzero(fdstatus_, sizeof(int)*MAX_POLL_FDS);
+
+	wakefd_ = eventfd(0, EFD_NONBLOCK);
+	VERIFY(wakefd_ >= 0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = wakefd_;
+	VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, wakefd_, &ev) == 0);
 }
 
 EPollAIO::~EPollAIO()
 {
+	close(wakefd_);
 	close(pollfd_);
 }
 
@@ -284,22 +370,24 @@ int poll_flag_to_event(poll_flag flag)
 	return f;
 }
 
+//edge-triggered: an event comes when the fd becomes readable or
+//writable, not for as long as it is
 void
 EPollAIO::watch_fd(int fd, poll_flag flag)
 {
-	VERIFY(fd < MAX_POLL_FDS);
-
 	struct epoll_event ev;
-	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-	fdstatus_[fd] |= (int)flag;
+	int status = fdstatus_.get(fd);
+	int op = status ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	status |= (int)flag;
+	fdstatus_.set(fd, status);
 
 	ev.events = EPOLLET;
 	ev.data.fd = fd;
 
-	if (fdstatus_[fd] & CB_RDONLY) {
+	if (status & CB_RDONLY) {
 		ev.events |= EPOLLIN;
 	}
-	if (fdstatus_[fd] & CB_WRONLY) {
+	if (status & CB_WRONLY) {
 		ev.events |= EPOLLOUT;
 	}
 
@@ -313,19 +401,27 @@ EPollAIO::watch_fd(int fd, poll_flag flag)
 bool 
 EPollAIO::unwatch_fd(int fd, poll_flag flag)
 {
-	VERIFY(fd < MAX_POLL_FDS);
-	fdstatus_[fd] &= ~(int)flag;
+	if (flag == CB_RDWR) {
+		//block_remove_fd waits for wait_ready to come around
+		uint64_t one = 1;
+		VERIFY(write(wakefd_, &one, sizeof(one)) == sizeof(one));
+	}
+	int status = fdstatus_.get(fd);
+	if (status == 0)
+		return true; //a failed connection already dropped it
+	status &= ~(int)flag;
+	fdstatus_.set(fd, status);
 
 	struct epoll_event ev;
-	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+	int op = status ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
 
 	ev.events = EPOLLET;
 	ev.data.fd = fd;
 
-	if (fdstatus_[fd] & CB_RDONLY) {
+	if (status & CB_RDONLY) {
 		ev.events |= EPOLLIN;
 	}
-	if (fdstatus_[fd] & CB_WRONLY) {
+	if (status & CB_WRONLY) {
 		ev.events |= EPOLLOUT;
 	}
 
@@ -339,16 +435,22 @@ EPollAIO::unwatch_fd(int fd, poll_flag flag)
 bool
 EPollAIO::is_watched(int fd, poll_flag flag)
 {
-	VERIFY(fd < MAX_POLL_FDS);
-	return ((fdstatus_[fd] & CB_MASK) == flag);
+	return ((fdstatus_.get(fd) & flag) == flag);
 }
 
 void
-EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
+EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+		int timeout_ms)
 {
-	int nfds = epoll_wait(pollfd_, ready_,	MAX_POLL_FDS, -1);
+	int nfds = epoll_wait(pollfd_, &ready_[0], ready_.size(), timeout_ms);
 	for (int i = 0; i < nfds; i++) {
-		if (ready_[i].events & EPOLLIN) {
+		if (ready_[i].data.fd == wakefd_) {
+			uint64_t n;
+			VERIFY(read(wakefd_, &n, sizeof(n)) == sizeof(n));
+			continue;
+		}
+		//errors and hangups show up as a failed read
+		if (ready_[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
 			readable->push_back(ready_[i].data.fd);
 		}
 		if (ready_[i].events & EPOLLOUT) {
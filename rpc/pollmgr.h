@@ -2,13 +2,49 @@
 #define pollmgr_h 
 
 #include <sys/select.h>
+#include <strings.h>
 #include <vector>
 
 #ifdef __linux__
 #include <sys/epoll.h>
 #endif
 
-#define MAX_POLL_FDS 128
+#include "lang/verify.h"
+
+//events an epoll_wait returns at most, unless RPC_EPOLL_BATCH says
+#define DEFAULT_POLL_BATCH 256
+
+// A table indexed by fd that grows a chunk at a time. Chunks never
+// move once allocated, so get() needs no lock even while another
+// thread set()s; callers of set() serialize among themselves. Slots
+// that were never set read as T().
+template<class T>
+class fd_table {
+	public:
+		fd_table() { bzero(chunks_, sizeof(chunks_)); }
+		~fd_table() {
+			for (int i = 0; i < NCHUNKS; i++)
+				delete [] chunks_[i];
+		}
+		T get(int fd) {
+			if (fd < 0 || fd >= NCHUNKS * CHUNK)
+				return T();
+			T *c = __atomic_load_n(&chunks_[fd / CHUNK], __ATOMIC_ACQUIRE);
+			return c ? c[fd % CHUNK] : T();
+		}
+		void set(int fd, T v) {
+			VERIFY(fd >= 0 && fd < NCHUNKS * CHUNK);
+			T *c = chunks_[fd / CHUNK];
+			if (!c) {
+				c = new T[CHUNK]();
+				__atomic_store_n(&chunks_[fd / CHUNK], c, __ATOMIC_RELEASE);
+			}
+			c[fd % CHUNK] = v;
+		}
+	private:
+		enum { CHUNK = 1024, NCHUNKS = 1024 };
+		T *chunks_[NCHUNKS];
+};
 
 typedef enum {
 	CB_NONE = 0x0,
@@ -23,7 +59,9 @@ class aio_mgr {
 		virtual void watch_fd(int fd, poll_flag flag) = 0;
 		virtual bool unwatch_fd(int fd, poll_flag flag) = 0;
 		virtual bool is_watched(int fd, poll_flag flag) = 0;
-		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable) = 0;
+		// timeout_ms < 0 waits for an event
+		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+				int timeout_ms) = 0;
 		virtual ~aio_mgr() {}
 };
 
@@ -34,33 +72,49 @@ class aio_callback {
 		virtual ~aio_callback() {}
 };
 
+// A reactor: one thread waiting for socket events and running the
+// read and write callbacks of the fds watched through it. There are
+// several reactors (RPC_REACTORS, by default one per online CPU);
+// each connection is given one by Next() and stays with it.
+//
+// Events are edge-triggered where the system allows: a callback must
+// read or write until the socket would block, or call retry_read() to
+// have read_cb run again without a new event.
 class PollMgr {
 	public:
-		PollMgr();
+		PollMgr(int batch);
 		~PollMgr();
 
+		// the first reactor
 		static PollMgr *Instance();
-		static PollMgr *CreateInst();
+		// the reactors in turn
+		static PollMgr *Next();
+		static int Count();
 
 		void add_callback(int fd, poll_flag flag, aio_callback *ch);
 		void del_callback(int fd, poll_flag flag);
 		bool has_callback(int fd, poll_flag flag, aio_callback *ch);
 		void block_remove_fd(int fd);
+		// from read_cb: call it again on the next round, or
+		// (later) after a short pause
+		void retry_read(int fd, bool later);
 		void wait_loop();
 
 
-		static PollMgr *instance;
-		static int useful;
-		static int useless;
+		static PollMgr **reactors;
+		static int nreactors;
+		static unsigned int next;
 
 	private:
 		pthread_mutex_t m_;
 		pthread_cond_t changedone_c_;
 		pthread_t th_;
 
-		aio_callback *callbacks_[MAX_POLL_FDS];
+		fd_table<aio_callback *> callbacks_;
 		aio_mgr *aio_;
 		bool pending_change_;
+		std::vector<int> retry_;       // protected by m_
+		std::vector<int> retry_later_; // protected by m_
 
 };
 
@@ -72,7 +126,8 @@ class SelectAIO : public aio_mgr {
 		void watch_fd(int fd, poll_flag flag);
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
-		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+				int timeout_ms);
 
 	private:
 
@@ -88,17 +143,19 @@ class SelectAIO : public aio_mgr {
 #ifdef __linux__ 
 class EPollAIO : public aio_mgr {
 	public:
-		EPollAIO();
+		EPollAIO(int batch);
 		~EPollAIO();
 		void watch_fd(int fd, poll_flag flag);
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
-		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void wait_ready(std::vector<int> *readable, std::vector<int> *writable,
+				int timeout_ms);
 
 	private:
 		int pollfd_;
-		struct epoll_event ready_[MAX_POLL_FDS];
-		int fdstatus_[MAX_POLL_FDS];
+		int wakefd_; //eventfd; makes wait_ready return after a removal
+		std::vector<struct epoll_event> ready_;
+		fd_table<int> fdstatus_;
 
 };
 #endif /* __linux */
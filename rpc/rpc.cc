@@ -11,15 +11,19 @@
 
  Both rpcc and rpcs use the connection class as an abstraction for the
  underlying communication channel.  To send an RPC request/reply, one calls
- connection::send() which blocks until data is sent or the connection has failed
- (thus the caller can free the buffer when send() returns).  When a
+ connection::send() which writes what the socket takes right away and queues a
+ copy of the rest for the PollMgr reactor to write later (thus the caller can
+ free the buffer when send() returns).  When a
  request/reply is received, connection makes a callback into the corresponding
  rpcc or rpcs (see rpcc::got_pdu() and rpcs::got_pdu()).
 
  Thread organization:
  rpcc uses application threads to send RPC requests and blocks to receive the
- reply or error. All connections use a single PollMgr object to perform async
- socket IO.  PollMgr creates a single thread to examine the readiness of socket
+ reply or error. rpcc::async() sends a request without waiting; the caller
+ collects the reply later through the returned future, so one thread can keep
+ many requests in flight on the same connection. Connections use a few PollMgr
+ reactors to perform async socket IO, each connection staying with the one it
+ was given.  Each reactor has a single thread to examine the readiness of its socket
  file descriptors and informs the corresponding connection whenever a socket is
  ready to be read or written.  (We use asynchronous socket IO to reduce the
  number of threads needed to manage these connections; without async IO, at
@@ -70,25 +74,182 @@
 #include <netinet/tcp.h>
 #include <time.h>
 #include <netdb.h>
+#include <limits.h>
+#include <algorithm>
+#include <set>
+#include <vector>
 
+#include "futex.h"
 #include "jsl_log.h"
 #include "gettime.h"
 #include "lang/verify.h"
 
+unsigned long long rpc_bytes_copied;
+
 const rpcc::TO rpcc::to_max = { 120000 };
 const rpcc::TO rpcc::to_min = { 1000 };
 
 rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-: xid(xxid), un(xun), done(false)
+: xid(xxid), un(xun), done(false), fired(false), ev(0), sleeping(0), ch(NULL),
+  chan(-1), slot(-1)
+{
+}
+
+static unsigned long long
+now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// now_ms() rounded up, for deadlines: the wheel fires a timer once
+// now_ms() reaches it, so one of now_ms_ceil() + to never fires
+// before to ms have passed
+static unsigned long long
+now_ms_ceil()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + (ts.tv_nsec + 999999) / 1000000;
+}
+
+// the ticker. rpccs register in ticking_; armed_ counts the timers
+// armed in all of them. the ticker turns the wheels every
+// TIMER_TICK_MS while there are timers, and for TICKER_IDLE_MS after
+// the last one is gone, so that a steady stream of calls does not
+// have to wake it up each time; then it sleeps on ticker_ev_.
+#define TICKER_IDLE_MS 1000
+
+static pthread_once_t ticker_once_ = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ticker_m_ = PTHREAD_MUTEX_INITIALIZER;
+static std::set<rpcc *> ticking_;
+static int armed_;
+static int ticker_ev_;
+static int ticker_sleeping_;
+
+void
+rpcc::ticker_start()
+{
+	pthread_t th;
+	pthread_attr_t attr;
+	VERIFY(pthread_attr_init(&attr) == 0);
+	VERIFY(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0);
+	VERIFY(pthread_create(&th, &attr, rpcc::ticker, NULL) == 0);
+	VERIFY(pthread_attr_destroy(&attr) == 0);
+}
+
+void *
+rpcc::ticker(void *)
 {
-	VERIFY(pthread_mutex_init(&m,0) == 0);
-	VERIFY(pthread_cond_init(&c, 0) == 0);
+	unsigned long long idle_since = 0;
+	while (1) {
+		unsigned long long now = now_ms();
+		{
+			ScopedLock tl(&ticker_m_);
+			std::set<rpcc *>::iterator i;
+			for (i = ticking_.begin(); i != ticking_.end(); i++)
+				(*i)->turn_wheel(now);
+		}
+
+		if (__atomic_load_n(&armed_, __ATOMIC_SEQ_CST) > 0) {
+			idle_since = 0;
+		} else if (!idle_since) {
+			idle_since = now;
+		} else if (now - idle_since >= TICKER_IDLE_MS) {
+			__atomic_store_n(&ticker_sleeping_, 1, __ATOMIC_SEQ_CST);
+			int ev = __atomic_load_n(&ticker_ev_, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&armed_, __ATOMIC_SEQ_CST) == 0)
+				futex_wait(&ticker_ev_, ev);
+			__atomic_store_n(&ticker_sleeping_, 0, __ATOMIC_SEQ_CST);
+			idle_since = 0;
+			continue;
+		}
+
+		struct timespec ts;
+		ts.tv_sec = 0;
+		ts.tv_nsec = TIMER_TICK_MS * 1000000;
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+// wake ca's sender, which waits in finish(). done or fired is set
+void
+rpcc::wake(caller *ca)
+{
+	__atomic_add_fetch(&ca->ev, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ca->sleeping, __ATOMIC_SEQ_CST))
+		futex_wake(&ca->ev, 1);
 }
 
-rpcc::caller::~caller()
+// (re)arm ca's timer to go off at due (ms)
+void
+rpcc::arm(caller &ca, unsigned long long due)
 {
-	VERIFY(pthread_mutex_destroy(&m) == 0);
-	VERIFY(pthread_cond_destroy(&c) == 0);
+	{
+		ScopedLock tl(&timer_m_);
+		if (ca.slot < 0) {
+			if (__atomic_fetch_add(&armed_, 1, __ATOMIC_SEQ_CST) == 0) {
+				__atomic_add_fetch(&ticker_ev_, 1, __ATOMIC_SEQ_CST);
+				if (__atomic_load_n(&ticker_sleeping_, __ATOMIC_SEQ_CST))
+					futex_wake(&ticker_ev_, 1);
+			}
+		} else {
+			disarm(ca);
+			__atomic_add_fetch(&armed_, 1, __ATOMIC_SEQ_CST);
+		}
+		// the first tick that starts at or after due, so that
+		// the turn that looks at the slot finds the timer due
+		unsigned long long tick = (due + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+		tick = std::max(tick, wheel_tick_);
+		ca.due = due;
+		ca.slot = tick % TIMER_SLOTS;
+		ca.tprev = NULL;
+		ca.tnext = wheel_[ca.slot];
+		if (ca.tnext)
+			ca.tnext->tprev = &ca;
+		wheel_[ca.slot] = &ca;
+	}
+}
+
+// take ca's timer out of the wheel, if it is in. timer_m_ is held
+void
+rpcc::disarm(caller &ca)
+{
+	if (ca.slot < 0)
+		return;
+	if (ca.tprev)
+		ca.tprev->tnext = ca.tnext;
+	else
+		wheel_[ca.slot] = ca.tnext;
+	if (ca.tnext)
+		ca.tnext->tprev = ca.tprev;
+	ca.slot = -1;
+	__atomic_sub_fetch(&armed_, 1, __ATOMIC_SEQ_CST);
+}
+
+// fire the timers due by now (ms). after a long gap every slot is
+// looked at once.
+void
+rpcc::turn_wheel(unsigned long long now)
+{
+	ScopedLock tl(&timer_m_);
+	unsigned long long tick = now / TIMER_TICK_MS;
+	if (tick >= wheel_tick_ + TIMER_SLOTS)
+		wheel_tick_ = tick - TIMER_SLOTS + 1;
+	for (; wheel_tick_ <= tick; wheel_tick_++) {
+		caller *ca = wheel_[wheel_tick_ % TIMER_SLOTS];
+		while (ca) {
+			caller *next = ca->tnext;
+			if (ca->due <= now) {
+				disarm(*ca);
+				__atomic_store_n(&ca->fired, true, __ATOMIC_SEQ_CST);
+				wake(ca);
+			}
+			ca = next;
+		}
+	}
 }
 
 inline
@@ -101,11 +262,47 @@ void set_rand_seed()
 
 rpcc::rpcc(sockaddr_in d, bool retrans) :
 	dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0),
-	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false), xid_rep_done_(-1)
+	retrans_(retrans), reachable_(true), nchans_(1), chan_policy_(PER_THREAD), chan_next_(0), destroy_wait_ (false), xid_rep_done_(-1)
+{
+	init(retrans);
+}
+
+rpcc::rpcc(const std::string &d, bool retrans) :
+	srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0),
+	retrans_(retrans), reachable_(true), nchans_(1), chan_policy_(PER_THREAD), chan_next_(0), destroy_wait_ (false), xid_rep_done_(-1)
+{
+	memset(&dst_, 0, sizeof(dst_));
+	if(d.compare(0, 5, "unix:") == 0)
+		path_ = d.substr(5);
+	else
+		make_sockaddr(d.c_str(), &dst_);
+	init(retrans);
+}
+
+void
+rpcc::init(bool retrans)
 {
 	VERIFY(pthread_mutex_init(&m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
 	VERIFY(pthread_cond_init(&destroy_wait_c_, 0) == 0);
+	VERIFY(pthread_mutex_init(&timer_m_, 0) == 0);
+
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		chans_[i].c = NULL;
+		chans_[i].outstanding = 0;
+	}
+	char *chans_env = getenv("RPC_CHANNELS");
+	if (chans_env != NULL)
+		set_channels(atoi(chans_env));
+
+	for (int i = 0; i < TIMER_SLOTS; i++)
+		wheel_[i] = NULL;
+	wheel_tick_ = now_ms() / TIMER_TICK_MS;
+	pthread_once(&ticker_once_, &rpcc::ticker_start);
+	{
+		ScopedLock tl(&ticker_m_);
+		ticking_.insert(this);
+	}
 
 	if(retrans){
 		set_rand_seed();
@@ -134,21 +331,28 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
 rpcc::~rpcc()
 {
 	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n",
-			clt_nonce_, chan_?chan_->channo():-1);
-	if(chan_){
-		chan_->closeconn();
-		chan_->decref();
+			clt_nonce_, chans_[0].c?chans_[0].c->channo():-1);
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		if(chans_[i].c){
+			chans_[i].c->closeconn();
+			chans_[i].c->decref();
+		}
 	}
 	VERIFY(calls_.size() == 0);
+	{
+		ScopedLock tl(&ticker_m_);
+		ticking_.erase(this);
+	}
 	VERIFY(pthread_mutex_destroy(&m_) == 0);
 	VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+	VERIFY(pthread_mutex_destroy(&timer_m_) == 0);
 }
 
 int
 rpcc::bind(TO to)
 {
 	int r;
-	int ret = call(rpc_const::bind, 0, r, to);
+	int ret = call<rpc_const::bind>(0, r, to);
 	if(ret == 0){
 		ScopedLock ml(&m_);
 		bind_done_ = true;
@@ -171,11 +375,10 @@ rpcc::cancel(void)
     caller *ca = iter->second;
 
     jsl_log(JSL_DBG_2, "rpcc::cancel: force caller to fail\n");
-    {
-      ScopedLock cl(&ca->m);
-      ca->done = true;
+    if (!ca->done) {
       ca->intret = rpc_const::cancel_failure;
-      VERIFY(pthread_cond_signal(&ca->c) == 0);
+      __atomic_store_n(&ca->done, true, __ATOMIC_SEQ_CST);
+      wake(ca);
     }
   }
 
@@ -192,7 +395,18 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 {
 
 	caller ca(0, &rep);
-        int xid_rep;
+	int ret = start(ca, proc, req, to.to);
+	if (ret < 0)
+		return ret;
+	// destruction of req automatically frees its buffer
+	return finish(ca, req);
+}
+
+// register ca in calls_ and send req for the first time.
+// returns < 0 if the call cannot be made at all.
+int
+rpcc::start(caller &ca, unsigned int proc, marshall &req, int to)
+{
 	{
 		ScopedLock ml(&m_);
 
@@ -207,85 +421,134 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		}
 
 		ca.xid = xid_++;
+		ca.proc = proc;
 		calls_[ca.xid] = &ca;
 
 		req_header h(ca.xid, proc, clt_nonce_, srv_nonce_,
                              xid_rep_window_.front());
 		req.pack_req_header(h);
-                xid_rep = xid_rep_window_.front();
+                ca.xid_rep = xid_rep_window_.front();
 	}
 
-	TO curr_to;
-	struct timespec now, nextdeadline, finaldeadline;
+	ca.deadline = now_ms_ceil() + to;
+	ca.curr_to = to_min.to;
+
+	transmit(ca, req);
+	return 0;
+}
 
-	clock_gettime(CLOCK_REALTIME, &now);
-	add_timespec(now, to.to, &finaldeadline);
-	curr_to.to = to_min.to;
+// send req on the current channel, reconnecting if needed
+void
+rpcc::transmit(caller &ca, marshall &req)
+{
+	get_refconn(ca);
+	if(ca.ch){
+		if(reachable_) {
+			request forgot;
+			{
+				ScopedLock ml(&m_);
+				if (dup_req_.isvalid() && xid_rep_done_ > dup_req_.xid) {
+					forgot = dup_req_;
+					dup_req_.clear();
+				}
+			}
+			if (forgot.isvalid())
+				ca.ch->send((char *)forgot.buf.c_str(), forgot.buf.size());
+			if (req.borrowed()) {
+				std::vector<struct iovec> v;
+				req.iov(&v);
+				ca.ch->send(&v[0], v.size());
+			} else {
+				ca.ch->send(req.cstr(), req.size());
+			}
+		}
+		else jsl_log(JSL_DBG_1, "not reachable\n");
+		jsl_log(JSL_DBG_2,
+				"rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
+				clt_nonce_, ca.proc, ca.xid, clt_nonce_);
+	}
+}
 
-	bool transmit = true;
-	connection *ch = NULL;
+// wait for the reply to a started call, retransmitting on a new
+// channel if the old one dies, until it arrives or the deadline passes.
+int
+rpcc::finish(caller &ca, marshall &req)
+{
+	bool transmit_again = false;
+	bool last = false;
 
 	while (1){
-		if(transmit){
-			get_refconn(&ch);
-			if(ch){
-			        if(reachable_) {
-                                        request forgot;
-                                        {
-                                                ScopedLock ml(&m_);
-                                                if (dup_req_.isvalid() && xid_rep_done_ > dup_req_.xid) {
-                                                        forgot = dup_req_;
-                                                        dup_req_.clear();
-                                                }
-                                        }
-                                        if (forgot.isvalid())
-                                                ch->send((char *)forgot.buf.c_str(), forgot.buf.size());
-                                        ch->send(req.cstr(), req.size());
-                                }
-				else jsl_log(JSL_DBG_1, "not reachable\n");
-				jsl_log(JSL_DBG_2,
-						"rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
-						clt_nonce_, proc, ca.xid, clt_nonce_);
-			}
-			transmit = false; // only send once on a given channel
+		if(transmit_again){
+			transmit(ca, req);
+			transmit_again = false; // only send once on a given channel
 		}
 
-		if(!finaldeadline.tv_sec)
+		if(last)
 			break;
 
-		clock_gettime(CLOCK_REALTIME, &now);
-		add_timespec(now, curr_to.to, &nextdeadline);
-		if(cmp_timespec(nextdeadline,finaldeadline) > 0){
-			nextdeadline = finaldeadline;
-			finaldeadline.tv_sec = 0;
+		unsigned long long due = now_ms() + ca.curr_to;
+		if(due >= ca.deadline){
+			due = ca.deadline;
+			last = true;
 		}
+		arm(ca, due);
 
-		{
-			ScopedLock cal(&ca.m);
-			while (!ca.done){
-			        jsl_log(JSL_DBG_2, "rpcc:call1: wait\n");
-				if(pthread_cond_timedwait(&ca.c, &ca.m,
-                                                 &nextdeadline) == ETIMEDOUT){
-				  	jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
-					break;
-				}
-			}
-			if(ca.done){
-			        jsl_log(JSL_DBG_2, "rpcc::call1: reply received\n");
+		while (1){
+			__atomic_store_n(&ca.sleeping, 1, __ATOMIC_SEQ_CST);
+			int ev = __atomic_load_n(&ca.ev, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&ca.done, __ATOMIC_SEQ_CST) ||
+			   __atomic_load_n(&ca.fired, __ATOMIC_SEQ_CST))
 				break;
-			}
+			jsl_log(JSL_DBG_2, "rpcc:call1: wait\n");
+			futex_wait(&ca.ev, ev);
+		}
+		__atomic_store_n(&ca.sleeping, 0, __ATOMIC_SEQ_CST);
+		if(ca.done){
+			jsl_log(JSL_DBG_2, "rpcc::call1: reply received\n");
+			break;
 		}
+		jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
+		ca.fired = false;
 
-		if(retrans_ && (!ch || ch->isdead())){
+		if(retrans_ && (!ca.ch || ca.ch->isdead())){
 			// since connection is dead, retransmit
                         // on the new connection
-			transmit = true;
+			transmit_again = true;
 		}
-		curr_to.to <<= 1;
+		ca.curr_to <<= 1;
 	}
 
+	forget(ca);
+
+        if (ca.done && lossytest_)
+        {
+                ScopedLock ml(&m_);
+                if (!dup_req_.isvalid()) {
+                        dup_req_.buf.assign(req.cstr(), req.size());
+                        dup_req_.xid = ca.xid;
+                }
+                if (ca.xid_rep > xid_rep_done_)
+                        xid_rep_done_ = ca.xid_rep;
+        }
+
+	jsl_log(JSL_DBG_2,
+			"rpcc::call1 %u call done for req proc %x xid %u %s:%d done? %d ret %d \n",
+			clt_nonce_, ca.proc, ca.xid, inet_ntoa(dst_.sin_addr),
+			ntohs(dst_.sin_port), ca.done, ca.intret);
+
+	return (ca.done? ca.intret : rpc_const::timeout_failure);
+}
+
+// take ca out of calls_; got_pdu can no longer reach it afterwards
+void
+rpcc::forget(caller &ca)
+{
 	{
-                // no locking of ca.m since only this thread changes ca.xid
+		ScopedLock tl(&timer_m_);
+		disarm(ca);
+	}
+	{
+                // only this thread changes ca.xid
 		ScopedLock ml(&m_);
 		calls_.erase(ca.xid);
 		// may need to update the xid again here, in case the
@@ -298,46 +561,118 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		}
 	}
 
-        if (ca.done && lossytest_)
-        {
-                ScopedLock ml(&m_);
-                if (!dup_req_.isvalid()) {
-                        dup_req_.buf.assign(req.cstr(), req.size());
-                        dup_req_.xid = ca.xid;
-                }
-                if (xid_rep > xid_rep_done_)
-                        xid_rep_done_ = xid_rep;
-        }
+	if(ca.ch){
+		ca.ch->decref();
+		ca.ch = NULL;
+	}
+	if(ca.chan >= 0){
+		ScopedLock ml(&chan_m_);
+		chans_[ca.chan].outstanding--;
+		ca.chan = -1;
+	}
+}
 
-	ScopedLock cal(&ca.m);
+rpcc::future::future(rpcc *cl)
+	: cl_(cl), ca_(0, &rep_), req_(true), ret_(0), finished_(false),
+	  tabled_(false)
+{
+}
 
-	jsl_log(JSL_DBG_2,
-			"rpcc::call1 %u call done for req proc %x xid %u %s:%d done? %d ret %d \n",
-			clt_nonce_, proc, ca.xid, inet_ntoa(dst_.sin_addr),
-			ntohs(dst_.sin_port), ca.done, ca.intret);
+rpcc::future::~future()
+{
+	if(!finished_)
+		cl_->forget(ca_);
+}
 
-	if(ch)
-		ch->decref();
+// true once the reply is in; wait() will not block then
+bool
+rpcc::future::done()
+{
+	if(finished_)
+		return true;
+	return __atomic_load_n(&ca_.done, __ATOMIC_SEQ_CST);
+}
 
-	// destruction of req automatically frees its buffer
-	return (ca.done? ca.intret : rpc_const::timeout_failure);
+// the return value of the RPC, as call() would return it
+int
+rpcc::future::wait()
+{
+	if(!finished_){
+		ret_ = cl_->finish(ca_, req_);
+		finished_ = true;
+	}
+	return ret_;
+}
+
+rpcc::future *
+rpcc::async_m(unsigned int proc, future *f, TO to)
+{
+	f->ret_ = start(f->ca_, proc, f->req_, to.to);
+	if(f->ret_ < 0)
+		f->finished_ = true;
+	// the arguments need not outlive async(), but wait() may have
+	// to send the request again
+	f->req_.flatten();
+	return f;
+}
+
+void
+rpcc::set_channels(int n, int policy)
+{
+	ScopedLock ml(&chan_m_);
+	nchans_ = std::max(1, std::min(n, (int)MAX_CHANNELS));
+	chan_policy_ = policy;
 }
 
+// the slot for a new call. chan_m_ is held
+int
+rpcc::pick_chan()
+{
+	if (nchans_ == 1)
+		return 0;
+	if (chan_policy_ == PER_THREAD) {
+		static unsigned int threads;
+		static __thread int thread_no = -1;
+		if (thread_no < 0)
+			thread_no = __atomic_fetch_add(&threads, 1, __ATOMIC_RELAXED) & INT_MAX;
+		return thread_no % nchans_;
+	}
+	// start the search somewhere else each time, so that ties are
+	// spread over the slots
+	int best = chan_next_++ % nchans_;
+	for (int k = 1; k < nchans_; k++) {
+		int i = (best + k) % nchans_;
+		if (chans_[i].outstanding < chans_[best].outstanding)
+			best = i;
+	}
+	return best;
+}
+
+// point ca.ch at the connection of ca's slot, taking a slot if ca has
+// none yet, and reconnecting if the slot's connection died
 void
-rpcc::get_refconn(connection **ch)
+rpcc::get_refconn(caller &ca)
 {
 	ScopedLock ml(&chan_m_);
-	if(!chan_ || chan_->isdead()){
-		if(chan_)
-			chan_->decref();
-		chan_ = connect_to_dst(dst_, this, lossytest_);
+	if(ca.chan < 0){
+		ca.chan = pick_chan();
+		chans_[ca.chan].outstanding++;
+	}
+	channel &ch = chans_[ca.chan];
+	if(!ch.c || ch.c->isdead()){
+		if(ch.c)
+			ch.c->decref();
+		if(path_.empty())
+			ch.c = connect_to_dst(dst_, this, lossytest_);
+		else
+			ch.c = connect_to_dst(path_.c_str(), this, lossytest_);
 	}
-	if(ch && chan_){
-		if(*ch){
-			(*ch)->decref();
+	if(ch.c){
+		if(ca.ch){
+			ca.ch->decref();
 		}
-		*ch = chan_;
-		(*ch)->incref();
+		ca.ch = ch.c;
+		ca.ch->incref();
 	}
 }
 
@@ -345,9 +680,9 @@ rpcc::get_refconn(connection **ch)
 // make this upcall from connection object to rpcc.
 // this funtion must not block.
 //
-// this function keeps no reference for connection *c
+// this function keeps no reference to the connection
 bool
-rpcc::got_pdu(connection *c, char *b, int sz)
+rpcc::got_pdu(connection *, char *b, int sz)
 {
 	unmarshall rep(b, sz);
 	reply_header h;
@@ -368,7 +703,6 @@ rpcc::got_pdu(connection *c, char *b, int sz)
 	}
 	caller *ca = calls_[h.xid];
 
-	ScopedLock cl(&ca->m);
 	if(!ca->done){
 		ca->un->take_in(rep);
 		ca->intret = h.ret;
@@ -376,9 +710,9 @@ rpcc::got_pdu(connection *c, char *b, int sz)
 			jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
 					h.xid, ca->intret);
 		}
-		ca->done = 1;
+		__atomic_store_n(&ca->done, true, __ATOMIC_SEQ_CST);
+		wake(ca);
 	}
-	VERIFY(pthread_cond_broadcast(&ca->c) == 0);
 	return true;
 }
 
@@ -409,12 +743,15 @@ compress:
 }
 
 
-rpcs::rpcs(unsigned int p1, int count)
-  : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true)
+rpcs::rpcs(unsigned int p1, int count, int minthreads, int maxthreads)
+  : port_(p1), reply_bytes_(0), reply_budget_(DEFAULT_REPLY_BUDGET), evictions_(0),
+    counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true),
+    blockpool_(NULL)
 {
 	VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&count_m_, 0) == 0);
-	VERIFY(pthread_mutex_init(&reply_window_m_, 0) == 0);
+	for (int i = 0; i < REPLY_SHARDS; i++)
+		VERIFY(pthread_mutex_init(&reply_shards_[i].m, 0) == 0);
 	VERIFY(pthread_mutex_init(&conss_m_, 0) == 0);
 
 	set_rand_seed();
@@ -426,17 +763,30 @@ rpcs::rpcs(unsigned int p1, int count)
 		lossytest_ = atoi(loss_env);
 	}
 
-	reg(rpc_const::bind, this, &rpcs::rpcbind);
-	dispatchpool_ = new ThrPool(6,false);
+	char *budget_env = getenv("RPC_REPLY_BUDGET");
+	if(budget_env != NULL){
+		reply_budget_ = strtoull(budget_env, NULL, 10);
+	}
+
+	reg<rpc_const::bind>(this, &rpcs::rpcbind);
+	dispatchpool_ = new ThrPool(minthreads, maxthreads, false);
 
 	listener_ = new tcpsconn(this, port_, lossytest_);
+	// a listener for clients on this host, if $RPC_UNIX_DIR asks for
+	// one; without it the server still serves TCP
+	std::string upath = unix_sock_path(port_);
+	ulistener_ = NULL;
+	if (!upath.empty())
+		ulistener_ = tcpsconn::unix_listener(this, upath.c_str(), lossytest_);
 }
 
 rpcs::~rpcs()
 {
 	// must delete listener before dispatchpool
 	delete listener_;
+	delete ulistener_;
 	delete dispatchpool_;
+	delete blockpool_;
 	free_reply_window();
 }
 
@@ -448,9 +798,32 @@ rpcs::got_pdu(connection *c, char *b, int sz)
             return true;
         }
 
+	// peek at the proc number in the request header to pick a pool.
+	// requests from one connection go to the same dispatch worker,
+	// which keeps the connection (and its reply path) in one cache.
+	ThrPool *pool = dispatchpool_;
+	int hint = c->channo();
+	if (blockpool_) {
+		int off = sizeof(rpc_sz_t) + sizeof(int); // length, xid
+#if RPC_CHECKSUMMING
+		off += sizeof(rpc_checksum_t);
+#endif
+		if (sz >= off + (int)sizeof(int)) {
+			unsigned int proc;
+			memcpy(&proc, b + off, sizeof(proc));
+			proc = ntohl(proc);
+			ScopedLock pl(&procs_m_);
+			std::map<int, int>::iterator it = procflags_.find(proc);
+			if (it != procflags_.end() && (it->second & PROC_BLOCKING)) {
+				pool = blockpool_;
+				hint = ThrPool::NO_HINT;
+			}
+		}
+	}
+
 	djob_t *j = new djob_t(c, b, sz);
 	c->incref();
-	bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
+	bool succ = pool->addObjJob(this, &rpcs::dispatch, j, hint);
 	if(!succ || !reachable_){
 		c->decref();
 		delete j;
@@ -467,6 +840,28 @@ rpcs::reg1(unsigned int proc, handler *h)
 	VERIFY(procs_.count(proc) >= 1);
 }
 
+void
+rpcs::set_procflags(unsigned int proc, int flags)
+{
+	ScopedLock pl(&procs_m_);
+	procflags_[proc] = flags;
+	if ((flags & PROC_BLOCKING) && !blockpool_)
+		blockpool_ = new ThrPool(1, BLOCKING_MAX_THREADS, false);
+}
+
+void
+rpcs::set_reply_budget(unsigned long long bytes)
+{
+	__atomic_store_n(&reply_budget_, bytes, __ATOMIC_RELAXED);
+}
+
+static void
+print_poolstat(const char *name, ThrPool *tp)
+{
+	printf("%s POOL: threads %d depth %u avg wait %llu us stolen %llu\n",
+	       name, tp->threads(), tp->depth(), tp->avg_wait_us(), tp->stolen());
+}
+
 void
 rpcs::updatestat(unsigned int proc)
 {
@@ -480,18 +875,25 @@ rpcs::updatestat(unsigned int proc)
 			printf("%x:%d ", i->first, i->second);
 		}
 		printf("\n");
-
-		ScopedLock rwl(&reply_window_m_);
-		std::map<unsigned int,std::list<reply_t> >::iterator clt;
-
-		unsigned int totalrep = 0, maxrep = 0;
-		for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-			totalrep += clt->second.size();
-			if(clt->second.size() > maxrep)
-				maxrep = clt->second.size();
+		print_poolstat("DISPATCH", dispatchpool_);
+		if (blockpool_)
+			print_poolstat("BLOCKING", blockpool_);
+
+		unsigned int nclients = 0, totalrep = 0, maxrep = 0;
+		for (int i = 0; i < REPLY_SHARDS; i++){
+			ScopedLock rwl(&reply_shards_[i].m);
+			std::map<unsigned int, window_t *>::iterator clt;
+			std::map<unsigned int, window_t *> &clients = reply_shards_[i].clients;
+			nclients += clients.size();
+			for (clt = clients.begin(); clt != clients.end(); clt++){
+				totalrep += clt->second->count;
+				if(clt->second->count > maxrep)
+					maxrep = clt->second->count;
+			}
 		}
-		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %d total reply %d max per client %d\n",
-                        (int) reply_window_.size(), totalrep, maxrep);
+		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %d total reply %d max per client %d "
+				"bytes %llu evicted %llu\n", nclients, totalrep, maxrep,
+				reply_bytes(), evictions());
 		curr_counts_ = counting_;
 	}
 }
@@ -532,6 +934,7 @@ rpcs::dispatch(djob_t *j)
 	}
 
 	handler *f;
+	bool idempotent;
 	// is RPC proc a registered procedure?
 	{
 		ScopedLock pl(&procs_m_);
@@ -544,6 +947,8 @@ rpcs::dispatch(djob_t *j)
 		}
 
 		f = procs_[proc];
+		std::map<int, int>::iterator fl = procflags_.find(proc);
+		idempotent = fl != procflags_.end() && (fl->second & PROC_IDEMPOTENT);
 	}
 
 	rpcs::rpcstate_t stat;
@@ -551,18 +956,6 @@ rpcs::dispatch(djob_t *j)
 	int sz1;
 
 	if(h.clt_nonce){
-		// have i seen this client before?
-		{
-			ScopedLock rwl(&reply_window_m_);
-			// if we don't know about this clt_nonce, create a cleanup object
-			if(reply_window_.find(h.clt_nonce) == reply_window_.end()){
-				VERIFY (reply_window_[h.clt_nonce].size() == 0); // create
-				jsl_log(JSL_DBG_2,
-						"rpcs::dispatch: new client %u xid %d chan %d, total clients %d\n",
-						h.clt_nonce, h.xid, c->channo(), (int)reply_window_.size());
-			}
-		}
-
 		// save the latest good connection to the client
 		{
 			ScopedLock rwl(&conss_m_);
@@ -583,8 +976,13 @@ rpcs::dispatch(djob_t *j)
 		stat = NEW;
 	}
 
+	// an evicted reply can be made again only by an idempotent proc
+	if(stat == EVICTED && !idempotent)
+		stat = FORGOTTEN;
+
 	switch (stat){
 		case NEW: // new request
+		case EVICTED: // duplicate whose reply we evicted: run it again
 			if(counting_){
 				updatestat(proc);
 			}
@@ -601,14 +999,15 @@ rpcs::dispatch(djob_t *j)
 
 			rep.pack_reply_header(rh);
 			rep.take_buf(&b1,&sz1);
+			pdu_seal(b1, sz1); // it will be shared
 
 			jsl_log(JSL_DBG_2,
 					"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
 					sz1, h.xid, proc, rh.ret, h.clt_nonce);
 
-			if(h.clt_nonce > 0){
+			if(h.clt_nonce > 0 && stat == NEW){
 				// only record replies for clients that require at-most-once logic
-				add_reply(h.clt_nonce, h.xid, b1, sz1);
+				add_reply(h.clt_nonce, h.xid, b1, sz1, idempotent);
 			}
 
 			// get the latest connection to the client
@@ -621,16 +1020,16 @@ rpcs::dispatch(djob_t *j)
 				}
 			}
 
-			c->send(b1, sz1);
-			if(h.clt_nonce == 0){
-				// reply is not added to at-most-once window, free it
-				free(b1);
-			}
+			// add_reply keeps a reference to b1, and so may the
+			// connection's send queue
+			c->send_shared(b1, sz1);
+			pdu_free(b1);
 			break;
 		case INPROGRESS: // server is working on this request
 			break;
 		case DONE: // duplicate and we still have the response
-			c->send(b1, sz1);
+			c->send_shared(b1, sz1);
+			pdu_free(b1);
 			break;
 		case FORGOTTEN: // very old request and we don't have the response anymore
 			jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n",
@@ -643,151 +1042,338 @@ rpcs::dispatch(djob_t *j)
 	c->decref();
 }
 
+rpcs::window_t::window_t() : size(WINDOW_MIN), acked(0), count(0)
+{
+	slots = new reply_t[size];
+}
+
+rpcs::window_t::~window_t()
+{
+	for (unsigned int i = 0; i < size; i++)
+		pdu_free(slots[i].buf);
+	delete [] slots;
+}
+
+rpcs::reply_t *
+rpcs::window_t::find(unsigned int xid)
+{
+	reply_t *r = &slots[xid & (size - 1)];
+	return (r->used && r->xid == xid) ? r : NULL;
+}
+
+// forget the RPCs below xid_rep; their replies are freed. returns
+// the bytes of reply freed.
+unsigned long long
+rpcs::window_t::ack(unsigned int xid_rep)
+{
+	unsigned long long freed = 0;
+	if (xid_rep <= acked)
+		return 0;
+	if (count > 0) {
+		if (xid_rep - acked >= size) {
+			for (unsigned int i = 0; i < size; i++) {
+				if (slots[i].used && slots[i].xid < xid_rep) {
+					if (slots[i].buf)
+						freed += slots[i].sz;
+					pdu_free(slots[i].buf);
+					slots[i] = reply_t();
+					count--;
+				}
+			}
+		} else {
+			for (unsigned int x = acked; x < xid_rep; x++) {
+				reply_t *r = find(x);
+				if (r) {
+					if (r->buf)
+						freed += r->sz;
+					pdu_free(r->buf);
+					*r = reply_t();
+					count--;
+				}
+			}
+		}
+	}
+	acked = xid_rep;
+	return freed;
+}
+
+void
+rpcs::window_t::grow()
+{
+	reply_t *old = slots;
+	unsigned int oldsize = size;
+	size *= 2;
+	slots = new reply_t[size];
+	for (unsigned int i = 0; i < oldsize; i++) {
+		if (old[i].used)
+			slots[old[i].xid & (size - 1)] = old[i];
+	}
+	delete [] old;
+}
+
 // rpcs::dispatch calls this when an RPC request arrives.
 //
 // checks to see if an RPC with xid from clt_nonce has already been received.
-// if not, remembers the request in reply_window_.
+// if not, remembers the request in the client's window.
 //
-// deletes remembered requests with XIDs <= xid_rep; the client
-// says it has received a reply for every RPC up through xid_rep.
-// frees the reply_t::buf of each such request.
+// deletes remembered requests with XIDs < xid_rep; the client
+// says it has received a reply for every RPC before xid_rep.
+// drops the reference to the reply of each such request.
 //
 // returns one of:
 //   NEW: never seen this xid before.
 //   INPROGRESS: seen this xid, and still processing it.
-//   DONE: seen this xid, previous reply returned in *b and *sz.
+//   DONE: seen this xid, previous reply returned in *b and *sz. *b is
+//         a new reference to the reply; the caller pdu_free()s it.
 //   FORGOTTEN: might have seen this xid, but deleted previous reply.
+//   EVICTED: seen this xid and replied, but evicted the reply.
 rpcs::rpcstate_t
 rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
                                 unsigned int xid_rep, char **b, int *sz)
 {
-    ScopedLock rwl(&reply_window_m_);
-
-    rpcstate_t r = NEW;
-
-    if (reply_window_.find(clt_nonce) == reply_window_.end())
-        reply_window_[clt_nonce] = std::list<reply_t>();
-    std::list<reply_t>* reply_t_ = &(reply_window_[clt_nonce]);
-
-    for (std::list<reply_t>::iterator iter = reply_t_->begin();
-         iter != reply_t_->end(); iter++)
-    {
-        if (iter->xid == xid)
-        {
-            if (!iter->cb_present)
-            {
-                r = INPROGRESS;
-            }
-            else
-            {
-                *sz = iter->sz;
-                *b = (char*)malloc(*sz);
-                memcpy(*b, iter->buf, *sz);
-                r = DONE;
-            }
-            break;
-        }
-    }
-
-    for (std::list<reply_t>::iterator iter = reply_t_->begin();
-         iter != reply_t_->end();)
-        if (iter->xid < xid_rep) // don't listen to the instructions for <=
-        {
-            free(iter->buf);
-            iter = reply_t_->erase(iter);
-        }
-        else
-            iter++;
-
-    unsigned int min_id = (unsigned int)-1;
-    for (std::list<reply_t>::iterator iter = reply_t_->begin();
-         iter != reply_t_->end(); iter++)
-        if (iter->xid < min_id) min_id = iter->xid;
-
-    if ((r == NEW && xid < min_id && !reply_t_->empty()) || xid < xid_rep)
-        r = FORGOTTEN;
-    else if (r == NEW)
-        reply_t_->push_back(reply_t(xid));
+	reply_shard_t &rs = reply_shard(clt_nonce);
+	ScopedLock rwl(&rs.m);
+
+	window_t *&w = rs.clients[clt_nonce];
+	if (!w) {
+		w = new window_t();
+		jsl_log(JSL_DBG_2, "rpcs::checkduplicate_and_update: new client %u xid %d\n",
+				clt_nonce, xid);
+	}
 
+	__atomic_sub_fetch(&reply_bytes_, w->ack(xid_rep), __ATOMIC_RELAXED);
+	if (xid < w->acked)
+		return FORGOTTEN;
+
+	reply_t *r = w->find(xid);
+	if (r) {
+		if (r->evicted)
+			return EVICTED;
+		if (!r->cb_present)
+			return INPROGRESS;
+		pdu_hold(r->buf);
+		*b = r->buf;
+		*sz = r->sz;
+		return DONE;
+	}
 
-    return r;
+	while (xid - w->acked >= w->size && w->size < WINDOW_MAX)
+		w->grow();
+	if (xid - w->acked >= w->size) {
+		// too far ahead of the client's acks: forget the oldest
+		jsl_log(JSL_DBG_1, "rpcs::checkduplicate_and_update: client %u "
+				"window full, forgetting xids below %u\n",
+				clt_nonce, xid - w->size + 1);
+		__atomic_sub_fetch(&reply_bytes_, w->ack(xid - w->size + 1),
+				__ATOMIC_RELAXED);
+	}
+	r = &w->slots[xid & (w->size - 1)];
+	VERIFY(!r->used);
+	r->used = true;
+	r->xid = xid;
+	w->count++;
+	return NEW;
 }
 
 // rpcs::dispatch calls add_reply when it is sending a reply to an RPC,
 // and passes the return value in b and sz.
-// add_reply() should remember b and sz.
-// free_reply_window() and checkduplicate_and_update is responsible for
-// calling free(b).
+// add_reply() keeps a reference to b (see pdu_hold), so b must not
+// change afterwards; the caller still drops its own.
+// window_t::ack and free_reply_window are responsible for
+// calling pdu_free(b).
 void
-rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz)
+rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz,
+		bool idempotent)
 {
-    ScopedLock rwl(&reply_window_m_);
-
-    VERIFY(reply_window_.find(clt_nonce) != reply_window_.end());
-    std::list<reply_t>* reply_t_ = &reply_window_[clt_nonce];
+	{
+		reply_shard_t &rs = reply_shard(clt_nonce);
+		ScopedLock rwl(&rs.m);
+
+		std::map<unsigned int, window_t *>::iterator clt = rs.clients.find(clt_nonce);
+		VERIFY(clt != rs.clients.end());
+		reply_t *r = clt->second->find(xid);
+		if (!r) {
+			// the client acked it already, or it fell out of a full window
+			return;
+		}
+		pdu_hold(b);
+		r->buf = b;
+		r->sz = sz;
+		r->cb_present = true;
+		r->idempotent = idempotent;
+	}
+	if (__atomic_add_fetch(&reply_bytes_, sz, __ATOMIC_RELAXED) >
+	    __atomic_load_n(&reply_budget_, __ATOMIC_RELAXED))
+		trim_replies(clt_nonce);
+}
 
-    for (std::list<reply_t>::iterator it = reply_t_->begin();
-         it != reply_t_->end(); it++)
-    {
-        if (it->xid == xid)
-        {
-            it->sz = sz;
-            it->buf = (char*)malloc(sz);
-            it->cb_present = true;
-            memcpy(it->buf, b, sz);
-            break;
-        }
-    }
+// evict cached replies until the windows are back within the budget,
+// starting with clt_nonce's shard. in each shard, replies of
+// idempotent procs go first, then other replies of at least
+// EVICT_MIN_SZ bytes; the largest of each kind first. a duplicate of
+// an evicted RPC gets EVICTED from checkduplicate_and_update.
+void
+rpcs::trim_replies(unsigned int clt_nonce)
+{
+	unsigned int first = clt_nonce % REPLY_SHARDS;
+	for (int i = 0; i < REPLY_SHARDS; i++) {
+		if (reply_bytes() <= __atomic_load_n(&reply_budget_, __ATOMIC_RELAXED))
+			return;
+		reply_shard_t &rs = reply_shards_[(first + i) % REPLY_SHARDS];
+		ScopedLock rwl(&rs.m);
+
+		// sort the candidates by size, idempotent ones above the rest
+		std::vector<std::pair<long long, reply_t *> > victims;
+		std::map<unsigned int, window_t *>::iterator clt;
+		for (clt = rs.clients.begin(); clt != rs.clients.end(); clt++) {
+			window_t *w = clt->second;
+			for (unsigned int k = 0; k < w->size; k++) {
+				reply_t *r = &w->slots[k];
+				if (!r->buf || (!r->idempotent && r->sz < EVICT_MIN_SZ))
+					continue;
+				long long key = r->sz + (r->idempotent ? (1LL << 32) : 0);
+				victims.push_back(std::make_pair(key, r));
+			}
+		}
+		std::sort(victims.begin(), victims.end());
+		while (!victims.empty() && reply_bytes() >
+		       __atomic_load_n(&reply_budget_, __ATOMIC_RELAXED)) {
+			reply_t *r = victims.back().second;
+			victims.pop_back();
+			__atomic_sub_fetch(&reply_bytes_, r->sz, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&evictions_, 1, __ATOMIC_RELAXED);
+			pdu_free(r->buf);
+			r->buf = NULL;
+			r->sz = 0;
+			r->evicted = true;
+		}
+	}
 }
 
 void
 rpcs::free_reply_window(void)
 {
-	std::map<unsigned int,std::list<reply_t> >::iterator clt;
-	std::list<reply_t>::iterator it;
-
-	ScopedLock rwl(&reply_window_m_);
-	for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-		for (it = clt->second.begin(); it != clt->second.end(); it++){
-			free((*it).buf);
-		}
-		clt->second.clear();
+	std::map<unsigned int, window_t *>::iterator clt;
+
+	for (int i = 0; i < REPLY_SHARDS; i++){
+		ScopedLock rwl(&reply_shards_[i].m);
+		std::map<unsigned int, window_t *> &clients = reply_shards_[i].clients;
+		for (clt = clients.begin(); clt != clients.end(); clt++)
+			delete clt->second;
+		clients.clear();
 	}
-	reply_window_.clear();
 }
 
 // rpc handler
 int
-rpcs::rpcbind(int a, int &r)
+rpcs::rpcbind(int, int &r)
 {
 	jsl_log(JSL_DBG_2, "rpcs::rpcbind called return nonce %u\n", nonce_);
 	r = nonce_;
 	return 0;
 }
 
+// make room for n more bytes: at once for everything the hint says
+// is coming, and by doubling past that
 void
-marshall::rawbyte(unsigned char x)
+marshall::grow(int n)
 {
-	if(_ind >= _capa){
-		_capa *= 2;
+	int want = _ind + n;
+	int capa = RPC_HEADER_SZ + _hint;
+	if(capa < want){
+		capa = 2 * _capa;
+		if(capa < want)
+			capa = want;
+	}
+	if(isinline()){
+		char *b = pdu_alloc(capa);
+		memcpy(b, _buf, _ind);
+		_buf = b;
+	} else {
 		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
+		_buf = pdu_realloc(_buf, capa);
 		VERIFY(_buf);
 	}
+	_capa = capa;
+}
+
+void
+marshall::rawbyte(unsigned char x)
+{
+	if(_ind >= _capa)
+		grow(1);
 	_buf[_ind++] = x;
 }
 
 void
 marshall::rawbytes(const char *p, int n)
 {
-	if((_ind+n) > _capa){
-		_capa = _capa > n? 2*_capa:(_capa+n);
-		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
-	}
+	if((_ind+n) > _capa)
+		grow(n);
 	memcpy(_buf+_ind, p, n);
 	_ind += n;
+	rpc_count_copy(n);
+}
+
+void
+marshall::refbytes(const char *p, int n)
+{
+	if(!_borrow || n < BORROW_MIN_SZ){
+		rawbytes(p, n);
+		return;
+	}
+	segment sg = { _ind, p, n };
+	_segs.push_back(sg);
+	_segsz += n;
+}
+
+void
+marshall::flatten()
+{
+	if(_segs.empty())
+		return;
+	int sz = size();
+	char *b = pdu_alloc(sz);
+	int from = 0, to = 0;
+	for(unsigned i = 0; i < _segs.size(); i++){
+		memcpy(b+to, _buf+from, _segs[i].at-from);
+		to += _segs[i].at-from;
+		from = _segs[i].at;
+		memcpy(b+to, _segs[i].p, _segs[i].n);
+		to += _segs[i].n;
+	}
+	memcpy(b+to, _buf+from, _ind-from);
+	rpc_count_copy(sz);
+	if(!isinline())
+		pdu_free(_buf);
+	_buf = b;
+	_capa = _ind = sz;
+	_segs.clear();
+	_segsz = 0;
+}
+
+void
+marshall::iov(std::vector<struct iovec> *v)
+{
+	struct iovec e;
+	int from = 0;
+	v->clear();
+	for(unsigned i = 0; i < _segs.size(); i++){
+		if(_segs[i].at > from){
+			e.iov_base = _buf+from;
+			e.iov_len = _segs[i].at-from;
+			v->push_back(e);
+		}
+		from = _segs[i].at;
+		e.iov_base = (void *)_segs[i].p;
+		e.iov_len = _segs[i].n;
+		v->push_back(e);
+	}
+	if(_ind > from){
+		e.iov_base = _buf+from;
+		e.iov_len = _ind-from;
+		v->push_back(e);
+	}
 }
 
 marshall &
@@ -849,7 +1435,7 @@ marshall &
 operator<<(marshall &m, const std::string &s)
 {
 	m << (unsigned int) s.size();
-	m.rawbytes(s.data(), s.size());
+	m.refbytes(s.data(), s.size());
 	return m;
 }
 
@@ -884,7 +1470,7 @@ void
 unmarshall::take_in(unmarshall &another)
 {
 	if(_buf)
-		free(_buf);
+		pdu_free(_buf);
 	another.take_buf(&_buf, &_sz);
 	_ind = RPC_HEADER_SZ;
 	_ok = _sz >= RPC_HEADER_SZ?true:false;
@@ -999,6 +1585,29 @@ unmarshall::rawbytes(std::string &ss, unsigned int n)
 		swap(ss, tmps);
 		VERIFY(ss.size() == n);
 		_ind += n;
+		rpc_count_copy(n);
+	}
+}
+
+unmarshall &
+operator>>(unmarshall &u, rpc_view &v)
+{
+	unsigned sz;
+	u >> sz;
+	if(u.ok())
+		u.rawbytes(v, sz);
+	return u;
+}
+
+void
+unmarshall::rawbytes(rpc_view &v, unsigned int n)
+{
+	if((_ind+n) > (unsigned)_sz){
+		_ok = false;
+	} else {
+		v.data = _buf+_ind;
+		v.size = n;
+		_ind += n;
 	}
 }
 
@@ -1028,6 +1637,19 @@ make_sockaddr(const char *hostandport, struct sockaddr_in *dst){
 
 }
 
+// where rpcs(port) listens for clients on the same host: rpc.<port>.sock
+// in $RPC_UNIX_DIR, or "" if that is not set
+std::string
+unix_sock_path(unsigned int port)
+{
+	char *dir = getenv("RPC_UNIX_DIR");
+	if (dir == NULL || *dir == '\0')
+		return "";
+	char buf[32];
+	snprintf(buf, sizeof(buf), "/rpc.%u.sock", port);
+	return dir + std::string(buf);
+}
+
 void
 make_sockaddr(const char *host, const char *port, struct sockaddr_in *dst){
 
@@ -6,6 +6,9 @@
 #include <list>
 #include <map>
 #include <stdio.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 #include "thr_pool.h"
 #include "marshall.h"
@@ -27,31 +30,146 @@ class rpc_const {
 		static const int cancel_failure = -7;
 };
 
+// Protocol tables. RPC_PROC(proc, reply, args...) binds a proc number
+// to the types of its arguments and of its reply, as they go on the
+// wire. rpcc::call<proc>() and rpcs::reg<proc>() check the caller's
+// and the handler's types against it at compile time, so a client and
+// server that disagree on a proc do not build; procs without a table
+// are marshalled by the types the caller and handler happen to use.
+// each proc number can be bound only once in a program, before any
+// call or reg of it.
+template<unsigned int P> struct rpc_proc; // specialized by RPC_PROC
+
+#define RPC_PROC(proc, rep, ...) \
+	template<> struct rpc_proc<proc> { \
+		typedef rep reply_type; \
+		typedef std::tuple<__VA_ARGS__> arg_types; \
+	}
+
+// whether proc P has a protocol table
+template<unsigned int P, class = void>
+struct rpc_tabled : std::false_type {};
+template<unsigned int P>
+struct rpc_tabled<P, std::void_t<typename rpc_proc<P>::arg_types> >
+	: std::true_type {};
+
+// the bind handshake every rpcc makes
+RPC_PROC(rpc_const::bind, int, int);
+
+// the type a handler parameter of type T has on the wire
+template<class T> struct rpc_wire { typedef T type; };
+template<> struct rpc_wire<rpc_view> { typedef std::string type; };
+
+// the last type of Ts, void if there is none
+template<class... Ts> struct rpc_last { typedef void type; };
+template<class T> struct rpc_last<T> { typedef T type; };
+template<class T, class... Ts> struct rpc_last<T, Ts...> {
+	typedef typename rpc_last<Ts...>::type type;
+};
+
+// an argument a of a call to a proc whose table says T. a must be
+// a T, but for numbers, which are converted to T. a borrowing
+// marshall keeps pointers into strings, so they are never converted
+// into temporaries.
+template<class T, class A> inline decltype(auto)
+rpc_arg(const A &a)
+{
+	if constexpr (std::is_same<A, T>::value) {
+		return a;
+	} else {
+		static_assert(std::is_arithmetic<T>::value &&
+		    (std::is_arithmetic<A>::value || std::is_enum<A>::value),
+		    "argument type does not match the protocol table");
+		return T(a);
+	}
+}
+
 // rpc client endpoint.
 // manages a xid space per destination socket
 // threaded: multiple threads can be sending RPCs,
 class rpcc : public chanmgr {
 
+	public:
+		// channel policies and limit, see set_channels
+		enum { PER_THREAD, LEAST_OUTSTANDING };
+		enum { MAX_CHANNELS = 16 };
+
 	private:
 
 		//manages per rpc info
 		struct caller {
 			caller(unsigned int xxid, unmarshall *un);
-			~caller();
 
 			unsigned int xid;
 			unmarshall *un;
 			int intret;
-			bool done;
-			pthread_mutex_t m;
-			pthread_cond_t c;
+			bool done;  // the reply (or a cancel) is in
+			bool fired; // the timer went off
+			// futex word, bumped whenever done or fired is set;
+			// sleeping says the sender waits on it
+			int ev;
+			int sleeping;
+
+			// sender side, between start() and finish()
+			unsigned int proc;
+			int xid_rep;
+			connection *ch;
+			int chan;    // the slot of chans_ ch came from, or -1
+			int curr_to; // ms until the next retransmission check
+			unsigned long long deadline; // ms, CLOCK_MONOTONIC
+
+			// timer, under timer_m_. slot is -1 when not armed
+			unsigned long long due;
+			int slot;
+			caller *tprev, *tnext;
 		};
 
-		void get_refconn(connection **ch);
+		// timers. a sender waiting for its reply arms a timer in a
+		// wheel of TIMER_SLOTS slots of TIMER_TICK_MS each, hashed by
+		// when it is due (timers due more than a turn ahead stay put
+		// for later turns). when the timer goes off the sender wakes
+		// up to retransmit or give up. one ticker thread turns the
+		// wheels of all rpccs in the process.
+		enum {
+			TIMER_TICK_MS = 10,
+			TIMER_SLOTS = 512,
+		};
+		pthread_mutex_t timer_m_;
+		caller *wheel_[TIMER_SLOTS];
+		unsigned long long wheel_tick_; // the next tick to look at
+
+		void arm(caller &ca, unsigned long long due);
+		void disarm(caller &ca);
+		void turn_wheel(unsigned long long now);
+		static void wake(caller *ca);
+		static void *ticker(void *);
+		static void ticker_start();
+
+		void get_refconn(caller &ca);
+		int pick_chan();
 		void update_xid_rep(unsigned int xid);
 
+		int start(caller &ca, unsigned int proc, marshall &req, int to);
+		void transmit(caller &ca, marshall &req);
+		int finish(caller &ca, marshall &req);
+		void forget(caller &ca);
+		void init(bool retrans);
+
+		// the reply of a call to proc into r. a reply that does not
+		// unmarshall into r means the caller got the types of an
+		// untabled proc wrong, and is fatal; for a tabled proc the
+		// types were checked at compile time, so it can only be a
+		// broken peer, and the call fails
+		template<class R>
+			static int get_reply(unsigned int proc, int intret,
+					unmarshall &u, R & r);
+		template<class R>
+			static int get_checked_reply(int intret, unmarshall &u,
+					R & r);
+
 
 		sockaddr_in dst_;
+		std::string path_; // unix-domain socket; empty means dst_
 		unsigned int clt_nonce_;
 		unsigned int srv_nonce_;
 		bool bind_done_;
@@ -60,10 +178,21 @@ class rpcc : public chanmgr {
 		bool retrans_;
 		bool reachable_;
 
-		connection *chan_;
+		// the connections calls go out on. a call sticks to the slot
+		// it was given, and the slot is reconnected if its
+		// connection dies. outstanding counts the calls holding
+		// the slot. calls only use the first nchans_ slots.
+		struct channel {
+			connection *c;
+			int outstanding;
+		};
+		channel chans_[MAX_CHANNELS];
+		int nchans_;
+		int chan_policy_;
+		unsigned int chan_next_; // where LEAST_OUTSTANDING starts looking
 
 		pthread_mutex_t m_; // protect insert/delete to calls[]
-		pthread_mutex_t chan_m_;
+		pthread_mutex_t chan_m_; // protects chans_ and the policy
 
 		bool destroy_wait_;
 		pthread_cond_t destroy_wait_c_;
@@ -83,6 +212,12 @@ class rpcc : public chanmgr {
 	public:
 
 		rpcc(sockaddr_in d, bool retrans=true);
+		// d is [host:]port, as for make_sockaddr, or unix:path to
+		// reach a server on this host without going through TCP;
+		// an rpcs also listens on unix_sock_path(port) if
+		// $RPC_UNIX_DIR names a directory for its socket (one only
+		// this user may enter; it is created if need be).
+		rpcc(const std::string &d, bool retrans=true);
 		~rpcc();
 
 		struct TO {
@@ -98,6 +233,14 @@ class rpcc : public chanmgr {
 
 		void set_reachable(bool r) { reachable_ = r; }
 
+		// spread calls over n connections to the server, so that
+		// concurrent callers do not all queue behind one socket.
+		// PER_THREAD keeps each calling thread on one of them;
+		// LEAST_OUTSTANDING gives each call the one with the fewest
+		// calls in flight. the at-most-once state stays per rpcc.
+		// by default there is one channel, or $RPC_CHANNELS.
+		void set_channels(int n, int policy = PER_THREAD);
+
 		void cancel();
                 
                 int islossy() { return lossytest_ > 0; }
@@ -105,46 +248,100 @@ class rpcc : public chanmgr {
 		int call1(unsigned int proc, 
 				marshall &req, unmarshall &rep, TO to);
 
+		// an RPC started by async() and still in flight. any number
+		// of them can be outstanding on one rpcc; wait() blocks for
+		// the reply and retransmits meanwhile like call() does, so a
+		// call nobody waits for is sent only once. the caller deletes
+		// the future, which abandons the call if it is not done.
+		class future {
+			public:
+				~future();
+				bool done();
+				int wait();
+				template<class R>
+					int get(R & r);
+			private:
+				friend class rpcc;
+				future(rpcc *cl);
+				rpcc *cl_;
+				caller ca_;
+				marshall req_;
+				unmarshall rep_;
+				int ret_;
+				bool finished_;
+				bool tabled_; // see get_checked_reply
+		};
+		future *async_m(unsigned int proc, future *f, TO to);
+
 		bool got_pdu(connection *c, char *b, int sz);
 
 
 		template<class R>
-			int call_m(unsigned int proc, marshall &req, R & r, TO to);
+			int call_m(unsigned int proc, marshall &req, R & r, TO to,
+					bool tabled);
 
-		template<class R>
-			int call(unsigned int proc, R & r, TO to = to_max); 
-		template<class R, class A1>
-			int call(unsigned int proc, const A1 & a1, R & r, TO to = to_max); 
-		template<class R, class A1, class A2>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, R & r, 
-					TO to = to_max); 
-		template<class R, class A1, class A2, class A3>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, R & r, TO to = to_max);
-		template<class R, class A1, class A2, class A3, class A4, class A5>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, const A5 & a5, R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5,
-			class A6>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 & a6,
-						R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5, 
-			class A6, class A7>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 &a6, const A7 &a7,
-						R & r, TO to = to_max); 
+		// call<proc>(a1, ..., an, r [, to]) marshalls any number of
+		// arguments, waits for the reply and unmarshalls it into r.
+		// for a proc in a protocol table (see RPC_PROC) the types
+		// are checked against it at compile time.
+		template<unsigned int P, class... As>
+			int call(As &&... as);
 
+		// async<proc>(a1, ..., an [, to])
+		template<unsigned int P, class... As>
+			future *async(const As &... as);
+
+	private:
+		template<unsigned int P, class... As>
+			int call_tabled(As &&... as);
+		template<unsigned int P, class... As>
+			int call_untabled(As &&... as);
+
+		// whether the last of As is a timeout
+		template<class... As> static constexpr bool has_to() {
+			return std::is_same<typename std::decay<
+				typename rpc_last<As...>::type>::type, TO>::value;
+		}
+		template<bool to, class T> static TO timeout_of(const T &t) {
+			if constexpr (to)
+				return std::get<std::tuple_size<T>::value - 1>(t);
+			else
+				return to_max;
+		}
+		// the hint for a marshall of x: its wire size, less what a
+		// borrowing marshall does not copy (see copied_size)
+		template<bool borrow, class T> static int hint_of(const T &x) {
+			if constexpr (borrow)
+				return copied_size(x);
+			else
+				return wire_size(x);
+		}
+		// the hint for a marshall of the arguments in t
+		template<bool borrow, class T, std::size_t... I>
+			static int wire_size_of(const T &t, std::index_sequence<I...>) {
+				return (0 + ... + hint_of<borrow>(std::get<I>(t)));
+			}
+		template<bool borrow, class Args, class T, std::size_t... I>
+			static int wire_size_as(const T &t, std::index_sequence<I...>) {
+				return (0 + ... + hint_of<borrow>(rpc_arg<typename
+					std::tuple_element<I, Args>::type>(std::get<I>(t))));
+			}
+		template<class T, std::size_t... I>
+			static void pack(marshall &m, const T &t,
+					std::index_sequence<I...>) {
+				(void)(m << ... << std::get<I>(t));
+			}
+		template<class Args, class T, std::size_t... I>
+			static void pack_as(marshall &m, const T &t,
+					std::index_sequence<I...>) {
+				(void)(m << ... << rpc_arg<typename
+					std::tuple_element<I, Args>::type>(std::get<I>(t)));
+			}
 };
 
-template<class R> int 
-rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to) 
+template<class R> int
+rpcc::get_reply(unsigned int proc, int intret, unmarshall &u, R & r)
 {
-	unmarshall u;
-	int intret = call1(proc, req, u, to);
 	if (intret < 0) return intret;
 	u >> r;
 	if(u.okdone() != true) {
@@ -158,98 +355,100 @@ rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to)
 }
 
 template<class R> int
-rpcc::call(unsigned int proc, R & r, TO to) 
-{
-	marshall m;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1> int
-rpcc::call(unsigned int proc, const A1 & a1, R & r, TO to) 
+rpcc::get_checked_reply(int intret, unmarshall &u, R & r)
 {
-	marshall m;
-	m << a1;
-	return call_m(proc, m, r, to);
+	if (intret < 0)
+		return intret;
+	u >> r;
+	if (!u.okdone())
+		return rpc_const::unmarshal_reply_failure;
+	return intret;
 }
 
-template<class R, class A1, class A2> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		R & r, TO to) 
+template<class R> int
+rpcc::future::get(R & r)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	return call_m(proc, m, r, to);
+	if (tabled_)
+		return get_checked_reply(wait(), rep_, r);
+	return get_reply(ca_.proc, wait(), rep_, r);
 }
 
-template<class R, class A1, class A2, class A3> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, R & r, TO to) 
+template<unsigned int P, class... As> rpcc::future *
+rpcc::async(const As &... as)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	return call_m(proc, m, r, to);
+	constexpr bool to = has_to<As...>();
+	constexpr std::size_t n = sizeof...(As) - to;
+	auto t = std::forward_as_tuple(as...);
+	future *f = new future(this);
+	if constexpr (rpc_tabled<P>::value) {
+		typedef typename rpc_proc<P>::arg_types args;
+		static_assert(n == std::tuple_size<args>::value,
+		    "wrong number of arguments for this proc");
+		f->tabled_ = true;
+		f->req_.expect(wire_size_as<false, args>(t, std::make_index_sequence<n>()));
+		pack_as<args>(f->req_, t, std::make_index_sequence<n>());
+	} else {
+		f->req_.expect(wire_size_of<false>(t, std::make_index_sequence<n>()));
+		pack(f->req_, t, std::make_index_sequence<n>());
+	}
+	return async_m(P, f, timeout_of<to>(t));
 }
 
-template<class R, class A1, class A2, class A3, class A4> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, R & r, TO to) 
+template<class R> int 
+rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to, bool tabled)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	return call_m(proc, m, r, to);
+	unmarshall u;
+	int intret = call1(proc, req, u, to);
+	if (tabled)
+		return get_checked_reply(intret, u, r);
+	return get_reply(proc, intret, u, r);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, R & r, TO to) 
+template<unsigned int P, class... As> int
+rpcc::call(As &&... as)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	return call_m(proc, m, r, to);
+	if constexpr (rpc_tabled<P>::value)
+		return call_tabled<P>(std::forward<As>(as)...);
+	else
+		return call_untabled<P>(std::forward<As>(as)...);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, R & r, TO to) 
+template<unsigned int P, class... As> int
+rpcc::call_untabled(As &&... as)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
-	return call_m(proc, m, r, to);
+	static_assert(!rpc_tabled<P>::value,
+	    "a tabled proc must be marshalled as its table says");
+	constexpr bool to = has_to<As...>();
+	constexpr std::size_t n = sizeof...(As) - 1 - to; // the reply's index
+	auto t = std::forward_as_tuple(std::forward<As>(as)...);
+	static_assert(std::is_lvalue_reference<
+	    typename std::tuple_element<n, decltype(t)>::type>::value,
+	    "the reply must be a variable");
+	marshall m(true, wire_size_of<true>(t, std::make_index_sequence<n>()));
+	pack(m, t, std::make_index_sequence<n>());
+	return call_m(P, m, std::get<n>(t), timeout_of<to>(t), false);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6, class A7> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, const A7 & a7,
-		R & r, TO to) 
+template<unsigned int P, class... As> int
+rpcc::call_tabled(As &&... as)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
-	m << a7;
-	return call_m(proc, m, r, to);
+	typedef rpc_proc<P> sig;
+	constexpr bool to = has_to<As...>();
+	constexpr std::size_t n = sizeof...(As) - 1 - to;
+	static_assert(n == std::tuple_size<typename sig::arg_types>::value,
+	    "wrong number of arguments for this proc");
+	auto t = std::forward_as_tuple(std::forward<As>(as)...);
+	static_assert(std::is_lvalue_reference<
+	    typename std::tuple_element<n, decltype(t)>::type>::value,
+	    "the reply must be a variable");
+	static_assert(std::is_same<typename std::decay<
+	    typename std::tuple_element<n, decltype(t)>::type>::type,
+	    typename sig::reply_type>::value,
+	    "reply type does not match the protocol table");
+	marshall m(true, wire_size_as<true, typename sig::arg_types>(t,
+	    std::make_index_sequence<n>()));
+	pack_as<typename sig::arg_types>(m, t, std::make_index_sequence<n>());
+	return call_m(P, m, std::get<n>(t), timeout_of<to>(t), true);
 }
 
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
@@ -261,6 +460,41 @@ class handler {
 		virtual int fn(unmarshall &, marshall &) = 0;
 };
 
+// a handler that is a method of S taking arguments and, last, the
+// reply by reference. the arguments are unmarshalled into their own
+// variables and moved into by-value parameters.
+template<class S, class... Ps>
+class method_handler : public handler {
+	private:
+		typedef typename rpc_last<Ps...>::type R;
+		static_assert(std::is_lvalue_reference<R>::value &&
+		    !std::is_const<typename std::remove_reference<R>::type>::value,
+		    "a handler's last parameter is its reply, by reference");
+
+		S *sob_;
+		int (S::*meth_)(Ps...);
+
+		template<std::size_t... I>
+			int run(unmarshall &args, marshall &ret,
+					std::index_sequence<I...>) {
+				std::tuple<typename std::decay<Ps>::type...> v;
+				(void)(args >> ... >> std::get<I>(v));
+				if(!args.okdone())
+					return rpc_const::unmarshal_args_failure;
+				typename std::decay<R>::type &r = std::get<sizeof...(I)>(v);
+				int b = (sob_->*meth_)(std::move(std::get<I>(v))..., r);
+				ret.expect(wire_size(r));
+				ret << r;
+				return b;
+			}
+	public:
+		method_handler(S *sob, int (S::*meth)(Ps...))
+			: sob_(sob), meth_(meth) { }
+		int fn(unmarshall &args, marshall &ret) {
+			return run(args, ret, std::make_index_sequence<sizeof...(Ps) - 1>());
+		}
+};
+
 
 // rpc server endpoint.
 class rpcs : public chanmgr {
@@ -270,25 +504,56 @@ class rpcs : public chanmgr {
 		INPROGRESS, // duplicate of an RPC we're still processing
 		DONE, // duplicate of an RPC we already replied to (have reply)
 		FORGOTTEN,  // duplicate of an old RPC whose reply we've forgotten
+		EVICTED,  // duplicate of an RPC whose reply we dropped to save memory
 	} rpcstate_t;
 
 	private:
 
-        // state about an in-progress or completed RPC, for at-most-once.
-        // if cb_present is true, then the RPC is complete and a reply
-        // has been sent; in that case buf points to a copy of the reply,
-        // and sz holds the size of the reply.
+	// state about an in-progress or completed RPC, for at-most-once.
+	// if cb_present is true, then the RPC is complete and a reply
+	// has been sent; in that case buf holds a reference to the reply
+	// (the very buffer that was sent, see pdu_hold), and sz its size,
+	// unless the reply was evicted to keep within the reply budget.
 	struct reply_t {
-		reply_t (unsigned int _xid) {
-			xid = _xid;
-			cb_present = false;
-			buf = NULL;
-			sz = 0;
-		}
+		reply_t() : xid(0), used(false), cb_present(false), evicted(false),
+			idempotent(false), buf(NULL), sz(0) {}
 		unsigned int xid;
+		bool used;       // the slot holds xid
 		bool cb_present; // whether the reply buffer is valid
-		char *buf;      // the reply buffer
-		int sz;         // the size of reply buffer
+		bool evicted;    // the reply was sent but not kept
+		bool idempotent; // the proc is PROC_IDEMPOTENT
+		char *buf;       // the reply buffer
+		int sz;          // the size of reply buffer
+	};
+
+	// a client's window: the RPCs it may still retransmit, those from
+	// xid acked on, in a ring indexed by xid modulo its size (a power
+	// of two). the ring doubles when a new xid does not fit, up to
+	// WINDOW_MAX; past that the oldest RPCs are forgotten.
+	struct window_t {
+		window_t();
+		~window_t();
+		reply_t *find(unsigned int xid);
+		unsigned long long ack(unsigned int xid_rep); // bytes freed
+		void grow();
+		reply_t *slots;
+		unsigned int size;
+		unsigned int acked; // the client has every reply below this
+		unsigned int count; // slots in use
+	};
+
+	// clients are spread over REPLY_SHARDS shards by nonce, each with
+	// its own lock, so clients do not contend for one
+	struct reply_shard_t {
+		pthread_mutex_t m;
+		std::map<unsigned int, window_t *> clients;
+	};
+
+	enum {
+		REPLY_SHARDS = 16,
+		WINDOW_MIN = 16,
+		WINDOW_MAX = 4096,
+		EVICT_MIN_SZ = 4096, // smaller replies of other procs stay
 	};
 
 	int port_;
@@ -296,11 +561,22 @@ class rpcs : public chanmgr {
 
 	// provide at most once semantics by maintaining a window of replies
 	// per client that that client hasn't acknowledged receiving yet.
-        // indexed by client nonce.
-	std::map<unsigned int, std::list<reply_t> > reply_window_;
+	reply_shard_t reply_shards_[REPLY_SHARDS];
+	reply_shard_t &reply_shard(unsigned int clt_nonce) {
+		return reply_shards_[clt_nonce % REPLY_SHARDS];
+	}
+
+	// bytes of replies the windows keep, and how many may be kept.
+	// over the budget, replies are evicted from the windows: those
+	// of PROC_IDEMPOTENT procs first, then large ones, largest first
+	unsigned long long reply_bytes_;
+	unsigned long long reply_budget_;
+	unsigned long long evictions_;
 
 	void free_reply_window(void);
-	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz,
+			bool idempotent);
+	void trim_replies(unsigned int clt_nonce);
 
 	rpcstate_t checkduplicate_and_update(unsigned int clt_nonce, 
 			unsigned int xid, unsigned int rep_xid,
@@ -319,12 +595,12 @@ class rpcs : public chanmgr {
 	int lossytest_; 
 	bool reachable_;
 
-	// map proc # to function
+	// map proc # to function, and to its PROC_* flags
 	std::map<int, handler *> procs_;
+	std::map<int, int> procflags_;
 
 	pthread_mutex_t procs_m_; // protect insert/delete to procs[]
 	pthread_mutex_t count_m_;  //protect modification of counts
-	pthread_mutex_t reply_window_m_; // protect reply window et al
 	pthread_mutex_t conss_m_; // protect conns_
 
 
@@ -342,12 +618,53 @@ class rpcs : public chanmgr {
 	void reg1(unsigned int proc, handler *);
 
 	ThrPool* dispatchpool_;
+	ThrPool* blockpool_; // for PROC_BLOCKING procs; NULL until one is set
 	tcpsconn* listener_;
+	tcpsconn* ulistener_; // on unix_sock_path(port_), or NULL
 
 	public:
-	rpcs(unsigned int port, int counts=0);
+	enum {
+		DISPATCH_MIN_THREADS = 6,
+		DISPATCH_MAX_THREADS = 32,
+		BLOCKING_MAX_THREADS = 256,
+	};
+	// proc flags
+	enum {
+		PROC_BLOCKING = 0x1, // handler may sleep for long (e.g. waiting
+		                     // for a lock); run it on its own pool so it
+		                     // cannot starve the other procs of threads
+		PROC_IDEMPOTENT = 0x2, // running it again gives the same reply;
+		                       // a duplicate whose reply was evicted is
+		                       // run again instead of failing
+	};
+	enum {
+		DEFAULT_REPLY_BUDGET = 64 << 20,
+	};
+
+	// the dispatch pool starts with minthreads and grows up to
+	// maxthreads while requests queue up
+	rpcs(unsigned int port, int counts=0,
+	     int minthreads=DISPATCH_MIN_THREADS,
+	     int maxthreads=DISPATCH_MAX_THREADS);
 	~rpcs();
 
+	// set before clients start calling proc
+	void set_procflags(unsigned int proc, int flags);
+
+	// bytes of cached replies to keep at most, by default
+	// DEFAULT_REPLY_BUDGET or $RPC_REPLY_BUDGET
+	void set_reply_budget(unsigned long long bytes);
+	unsigned long long reply_bytes() {
+		return __atomic_load_n(&reply_bytes_, __ATOMIC_RELAXED);
+	}
+	unsigned long long evictions() {
+		return __atomic_load_n(&evictions_, __ATOMIC_RELAXED);
+	}
+
+	// the pools, for their size, depth and wait time (see ThrPool)
+	ThrPool *dispatchpool() { return dispatchpool_; }
+	ThrPool *blockpool() { return blockpool_; }
+
 	//RPC handler for clients binding
 	int rpcbind(int a, int &r);
 
@@ -355,268 +672,27 @@ class rpcs : public chanmgr {
 
 	bool got_pdu(connection *c, char *b, int sz);
 
-	// register a handler
-	template<class S, class A1, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, R & r));
-	template<class S, class A1, class A2, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, const A2, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, const A5, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class A7, class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, const A7,
-						R & r));
-};
-
-template<class S, class A1, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				R r;
-				args >> a1;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				R r;
-				args >> a1;
-				args >> a2;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, R & r))
-				: sob(xsob), meth(xmeth)  { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class A5, class A6, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class A5, 
-	class A6, class A7, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6,
-			const A7 a7, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, const A7 a7, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6,
-						const A7 a7, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				A7 a7;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				args >> a7;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, a7, r);
-				ret << r;
-				return b;
+	// register a handler for proc: a method of S whose last
+	// parameter is the reply, by reference. if proc has a protocol
+	// table (see RPC_PROC), the method must match it.
+	template<unsigned int P, class S, class... Ps>
+		void reg(S *sob, int (S::*meth)(Ps...)) {
+			if constexpr (rpc_tabled<P>::value) {
+				typedef rpc_proc<P> sig;
+				typedef decltype(std::tuple_cat(
+				    std::declval<typename sig::arg_types>(),
+				    std::declval<std::tuple<typename sig::reply_type> >())) want;
+				static_assert(std::is_same<std::tuple<typename rpc_wire<
+				    typename std::decay<Ps>::type>::type...>, want>::value,
+				    "handler does not match the protocol table");
 			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+			reg1(P, new method_handler<S, Ps...>(sob, meth));
+		}
+};
 
 
 void make_sockaddr(const char *hostandport, struct sockaddr_in *dst);
+std::string unix_sock_path(unsigned int port);
 void make_sockaddr(const char *host, const char *port,
 		struct sockaddr_in *dst);
 
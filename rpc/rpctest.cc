@@ -7,7 +7,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
 #include "jsl_log.h"
+#include "crc32c.h"
+#include "compress.h"
 #include "gettime.h"
 #include "lang/verify.h"
 
@@ -28,8 +35,18 @@ class srv {
 		int handle_fast(const int a, int &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		int handle_sink(const std::string a, int &r);
+		int handle_sink_view(const rpc_view a, int &r);
+		int handle_wait(const int a, int &r);
+		int handle_open(const int a, int &r);
 };
 
+// procs 22 and 23 have protocol tables, so their calls and handlers
+// are checked at compile time; the others are marshalled by the types
+// at hand
+RPC_PROC(22, std::string, std::string, std::string);
+RPC_PROC(23, int, int);
+
 // a handler. a and b are arguments, r is the result.
 // there can be multiple arguments but only one result.
 // the caller also gets to see the int return value
@@ -66,15 +83,65 @@ srv::handle_bigrep(const int len, std::string &r)
 	return 0;
 }
 
+// the same RPC on the wire; one handler gets a copy of the
+// argument, the other a view into the request
+int
+srv::handle_sink(const std::string a, int &r)
+{
+	r = a.size();
+	return 0;
+}
+
+int
+srv::handle_sink_view(const rpc_view a, int &r)
+{
+	r = a.size;
+	return 0;
+}
+
+// handle_wait blocks until someone calls handle_open, like a lock
+// acquire waiting for a release
+pthread_mutex_t gate_m = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gate_c = PTHREAD_COND_INITIALIZER;
+bool gate_open;
+
+int
+srv::handle_wait(const int a, int &r)
+{
+	pthread_mutex_lock(&gate_m);
+	while(!gate_open)
+		pthread_cond_wait(&gate_c, &gate_m);
+	pthread_mutex_unlock(&gate_m);
+	r = a;
+	return 0;
+}
+
+int
+srv::handle_open(const int a, int &r)
+{
+	pthread_mutex_lock(&gate_m);
+	gate_open = a;
+	pthread_cond_broadcast(&gate_c);
+	pthread_mutex_unlock(&gate_m);
+	r = 0;
+	return 0;
+}
+
 srv service;
 
 void startserver()
 {
 	server = new rpcs(port);
-	server->reg(22, &service, &srv::handle_22);
-	server->reg(23, &service, &srv::handle_fast);
-	server->reg(24, &service, &srv::handle_slow);
-	server->reg(25, &service, &srv::handle_bigrep);
+	server->reg<22>(&service, &srv::handle_22);
+	server->reg<23>(&service, &srv::handle_fast);
+	server->reg<24>(&service, &srv::handle_slow);
+	server->reg<25>(&service, &srv::handle_bigrep);
+	server->reg<26>(&service, &srv::handle_sink);
+	server->reg<27>(&service, &srv::handle_sink_view);
+	server->reg<28>(&service, &srv::handle_wait);
+	server->reg<29>(&service, &srv::handle_open);
+	server->set_procflags(28, rpcs::PROC_BLOCKING);
+	server->set_procflags(25, rpcs::PROC_IDEMPOTENT);
 }
 
 void
@@ -108,6 +175,145 @@ testmarshall()
 	un >> s1;
 	VERIFY(un.okdone());
 	VERIFY(i1==i && l1==l && s1==s);
+
+	// wire_size() predicts what operator<< writes, inline or not
+	std::vector<std::string> v(3, std::string(300, 'v'));
+	std::map<int, std::string> d;
+	d[1] = "one";
+	d[2] = "two";
+	int want = wire_size(i) + wire_size(l) + wire_size(v) + wire_size(d);
+	marshall m2(false, want);
+	m2 << i;
+	m2 << l;
+	m2 << v;
+	m2 << d;
+	VERIFY(m2.size() == RPC_HEADER_SZ + want);
+
+	// and copied_size() what a borrowing marshall keeps in its buffer
+	std::string big(BORROW_MIN_SZ, 'b');
+	want = copied_size(v) + copied_size(big) + copied_size(d);
+	marshall m3(true, want);
+	m3 << v;
+	m3 << big;
+	m3 << d;
+	std::vector<struct iovec> iv;
+	m3.iov(&iv);
+	int copied = 0;
+	for (unsigned k = 0; k < iv.size(); k++)
+		if (iv[k].iov_base != big.data())
+			copied += iv[k].iov_len;
+	VERIFY(copied == RPC_HEADER_SZ + want);
+	VERIFY(m3.size() == copied + (int) big.size());
+}
+
+// takes PDUs off a connection and counts them
+struct pdu_counter : public chanmgr {
+	pdu_counter(): n(0) {}
+	int n;
+	bool got_pdu(connection *, char *b, int) {
+		__atomic_add_fetch(&n, 1, __ATOMIC_SEQ_CST);
+		pdu_free(b);
+		return true;
+	}
+};
+
+void
+testchecksum()
+{
+	VERIFY(crc32c(0, "123456789", 9) == 0xe3069283);
+	VERIFY(crc32c_sw(0, "123456789", 9) == 0xe3069283);
+	static char buf[20000];
+	for(int i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = random();
+	for(int len = 0; len < (int)sizeof(buf) - 8; len += 1 + len / 8){
+		for(int off = 0; off < 8; off++){
+			uint32_t c = crc32c(0, buf + off, len);
+			VERIFY(c == crc32c_sw(0, buf + off, len));
+			int k = len / 3;
+			VERIFY(c == crc32c(crc32c(0, buf + off, k), buf + off + k, len - k));
+		}
+	}
+
+#if RPC_CHECKSUMMING
+	// a PDU damaged on the way kills the connection rather than
+	// being delivered
+	int sv[2];
+	VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	pdu_counter ma, mb;
+	connection *a = new connection(&ma, sv[0], 0);
+	connection *b = new connection(&mb, sv[1], 0);
+	marshall m;
+	m.pack_req_header(req_header(1, 2, 3, 4, 5));
+	m << std::string(5000, 'c');
+	VERIFY(a->send(m.cstr(), m.size()));
+	for(int i = 0; i < 100 && mb.n < 1; i++)
+		usleep(10000);
+	VERIFY(mb.n == 1 && !b->isdead());
+
+	char *p;
+	int sz;
+	m.take_buf(&p, &sz);
+	int nsz = htonl(sz);
+	memcpy(p, &nsz, sizeof(nsz));
+	pdu_seal(p, sz);
+	p[sz - 1] ^= 1;
+	VERIFY(write(sv[0], p, sz) == sz);
+	pdu_free(p);
+	for(int i = 0; i < 100 && !b->isdead(); i++)
+		usleep(10000);
+	VERIFY(b->isdead() && mb.n == 1);
+	a->closeconn();
+	a->decref();
+	b->closeconn();
+	b->decref();
+#endif
+}
+
+// n bytes of text-like data, with about pct percent of the bytes
+// replaced by random ones
+std::string
+entropic(int n, int pct)
+{
+	static const char *words[] = { "lock ", "extent ", "inode ", "acquire ",
+		"release ", "getattr ", "put ", "get ", "ok\n", "0x1f3a ", "yfs ", "rpc " };
+	std::string s;
+	while((int)s.size() < n)
+		s += words[random() % 12];
+	s.resize(n);
+	for(int i = 0; i < n; i++)
+		if(random() % 100 < pct)
+			s[i] = random();
+	return s;
+}
+
+void
+testcompress()
+{
+	int sizes[] = { 0, 1, 4, 9, 15, 16, 100, 270, 4096, 70000, 300000 };
+	int pcts[] = { 0, 10, 100 };
+	for(int i = 0; i < 11; i++){
+		for(int k = 0; k < 3; k++){
+			std::string s = entropic(sizes[i], pcts[k]);
+			if(k == 0 && i == 10)
+				s = std::string(sizes[i], 'z'); // one long run
+			std::vector<char> c(rpc_compress_bound(s.size()));
+			int n = rpc_compress(s.data(), s.size(), &c[0]);
+			VERIFY(n <= rpc_compress_bound(s.size()));
+			std::vector<char> d(s.size() + 1);
+			VERIFY(rpc_decompress(&c[0], n, &d[0], d.size()) == (int)s.size());
+			VERIFY(memcmp(&d[0], s.data(), s.size()) == 0);
+			if(s.size() > 0)
+				VERIFY(rpc_decompress(&c[0], n, &d[0], s.size() - 1) < 0);
+			if(pcts[k] == 0 && s.size() >= 4096)
+				VERIFY(n < (int)s.size() / 2);
+			// damaged blocks are refused, or at least stay in bounds
+			for(int j = 0; j < 20 && n > 0; j++){
+				std::vector<char> bad(c.begin(), c.begin() + n);
+				bad[random() % n] ^= 1 << (random() % 8);
+				rpc_decompress(&bad[0], n, &d[0], d.size());
+			}
+		}
+	}
 }
 
 void *
@@ -120,7 +326,7 @@ client1(void *xx)
 	for(int i = 0; i < 100; i++){
 		int arg = (random() % 2000);
 		std::string rep;
-		int ret = clients[which_cl]->call(25, arg, rep);
+		int ret = clients[which_cl]->call<25>(arg, rep);
 		VERIFY(ret == 0);
 		if ((int)rep.size()!=arg) {
 			printf("repsize wrong %d!=%d\n", (int)rep.size(), arg);
@@ -138,7 +344,8 @@ client1(void *xx)
 		struct timespec start,end;
 		clock_gettime(CLOCK_REALTIME, &start);
 
-		int ret = clients[which_cl]->call(which ? 23 : 24, arg, rep);
+		int ret = which ? clients[which_cl]->call<23>(arg, rep) :
+		    clients[which_cl]->call<24>(arg, rep);
 		clock_gettime(CLOCK_REALTIME, &end);
 		int diff = diff_timespec(end, start);
 		if (ret != 0)
@@ -161,7 +368,7 @@ client2(void *xx)
 	while(time(0) - t1 < 10){
 		int arg = (random() % 2000);
 		std::string rep;
-		int ret = clients[which_cl]->call(25, arg, rep);
+		int ret = clients[which_cl]->call<25>(arg, rep);
 		if ((int)rep.size()!=arg) {
 			printf("ask for %d reply got %d ret %d\n",
                                arg, (int)rep.size(), ret);
@@ -178,13 +385,499 @@ client3(void *xx)
 
 	for(int i = 0; i < 4; i++){
 		int rep;
-		int ret = c->call(24, i, rep, rpcc::to(3000));
+		int ret = c->call<24>(i, rep, rpcc::to(3000));
 		VERIFY(ret == rpc_const::timeout_failure || rep == i+2);
 	}
 	return 0;
 }
 
 
+// keep depth async calls in flight on one client for a second
+// and report how many complete per second.
+void
+pipeline_bench(rpcc *c)
+{
+	printf("pipeline_bench\n");
+	for(int depth = 1; depth <= 32; depth *= 2){
+		rpcc::future *f[depth];
+		int n = 0;
+		for(int i = 0; i < depth; i++)
+			f[i] = c->async<23>(i);
+
+		struct timespec start, now;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			// the oldest call is the most likely to be done
+			int i = n % depth;
+			int rep;
+			VERIFY(f[i]->get(rep) == 0 && rep == i + 1);
+			delete f[i];
+			f[i] = c->async<23>(i);
+			n++;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while(diff_timespec(now, start) < 1000);
+
+		for(int i = 0; i < depth; i++){
+			int rep;
+			VERIFY(f[i]->get(rep) == 0 && rep == i + 1);
+			delete f[i];
+		}
+		printf("   -- depth %2d: %d calls/s\n", depth,
+		       n * 1000 / diff_timespec(now, start));
+	}
+}
+
+// push trivial jobs through a dispatch-sized ThrPool from several
+// producers, as the PollMgr threads would, and report jobs/s. each
+// producer adds either to the shared queue or, like a connection,
+// with its own affinity hint.
+struct pool_counter {
+	unsigned long long done;
+	void job(int) { __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED); }
+};
+
+struct pool_producer {
+	ThrPool *tp;
+	pool_counter *pc;
+	int n;
+	int hint;
+};
+
+void *
+pool_produce(void *x)
+{
+	pool_producer *p = (pool_producer *) x;
+	for(int i = 0; i < p->n; i++)
+		VERIFY(p->tp->addObjJob(p->pc, &pool_counter::job, i, p->hint));
+	return 0;
+}
+
+void
+pool_bench()
+{
+	printf("pool_bench\n");
+	for(int np = 1; np <= 4; np *= 2)
+	for(int affine = 0; affine <= 1; affine++){
+		ThrPool *tp = new ThrPool(6, true);
+		pool_counter pc;
+		pc.done = 0;
+		pool_producer p[np];
+		pthread_t th[np];
+		for(int i = 0; i < np; i++){
+			p[i].tp = tp;
+			p[i].pc = &pc;
+			p[i].n = 1000000 / np;
+			p[i].hint = affine ? i : ThrPool::NO_HINT;
+		}
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int i = 0; i < np; i++)
+			VERIFY(pthread_create(&th[i], &attr, pool_produce, &p[i]) == 0);
+		for(int i = 0; i < np; i++)
+			VERIFY(pthread_join(th[i], NULL) == 0);
+		while(__atomic_load_n(&pc.done, __ATOMIC_RELAXED) <
+		      (unsigned long long) p[0].n * np)
+			usleep(100);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		unsigned long long stolen = tp->stolen();
+		delete tp;
+
+		int ms = diff_timespec(end, start);
+		printf("   -- %d producer(s), 6 workers, %s: %llu jobs/s, %llu stolen\n",
+		       np, affine ? "affine" : "shared", pc.done * 1000 / (ms ? ms : 1),
+		       stolen);
+	}
+}
+
+// bytes the RPC library copies per put-like call (a big string
+// argument), with the server taking the string or a view of it.
+// counts both ends when client and server share the process.
+void
+put_bench(rpcc *c)
+{
+	printf("put_bench\n");
+	int sizes[] = { 1000, 64000, 1000000 };
+	for(int i = 0; i < 3; i++){
+		std::string buf(sizes[i], 'p');
+		for(int proc = 26; proc <= 27; proc++){
+			int n = 200, r;
+			unsigned long long before = rpc_bytes_copied;
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for(int k = 0; k < n; k++){
+				VERIFY((proc == 26 ? c->call<26>(buf, r) :
+				    c->call<27>(buf, r)) == 0);
+				VERIFY(r == sizes[i]);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			unsigned long long copied = rpc_bytes_copied - before;
+			printf("   -- %7d byte put, %s: %.2f bytes copied per payload byte, %d us/call\n",
+			       sizes[i], proc == 26 ? "string" : "view  ",
+			       (double) copied / n / sizes[i],
+			       diff_timespec(end, start) * 1000 / n);
+		}
+	}
+}
+
+// open up to n client connections to the server, each its own rpcc,
+// then make one call on every one of them. reports how long the
+// connects and the round of calls take. a server in the same process
+// needs an fd per connection too, so run -s and -c apart for the
+// full count.
+void
+conns_bench(int n, bool alsoserver)
+{
+	printf("conns_bench\n");
+	struct rlimit rl;
+	VERIFY(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	VERIFY(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+	int most = ((int) rl.rlim_cur - 64) / (alsoserver ? 2 : 1);
+	if(n > most){
+		printf("   -- fd limit %d, only %d connections\n", (int) rl.rlim_cur, most);
+		n = most;
+	}
+
+	rpcc **cl = new rpcc *[n];
+	struct timespec start, mid, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < n; i++){
+		cl[i] = new rpcc(dst);
+		VERIFY(cl[i]->bind() == 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mid);
+	for(int i = 0; i < n; i++){
+		int r;
+		VERIFY(cl[i]->call<23>(i, r) == 0 && r == i + 1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	for(int i = 0; i < n; i++)
+		delete cl[i];
+	delete [] cl;
+
+	int ms = diff_timespec(mid, start);
+	printf("   -- %d connections: %d ms to bind, %d binds/s\n", n, ms,
+	       n * 1000 / (ms ? ms : 1));
+	ms = diff_timespec(end, mid);
+	printf("   -- one call on each: %d ms, %d calls/s\n", ms,
+	       n * 1000 / (ms ? ms : 1));
+}
+
+// the get-like counterpart of put_bench: a small request and a big
+// reply, which the server marshalls.
+void
+get_bench(rpcc *c)
+{
+	printf("get_bench\n");
+	int sizes[] = { 1000, 64000, 1000000 };
+	for(int i = 0; i < 3; i++){
+		int n = 200;
+		std::string rep;
+		unsigned long long before = rpc_bytes_copied;
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int k = 0; k < n; k++){
+			VERIFY(c->call<25>(sizes[i], rep) == 0);
+			VERIFY((int)rep.size() == sizes[i]);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		unsigned long long copied = rpc_bytes_copied - before;
+		printf("   -- %7d byte get: %.2f bytes copied per payload byte, %d us/call\n",
+		       sizes[i], (double) copied / n / sizes[i],
+		       diff_timespec(end, start) * 1000 / n);
+	}
+}
+
+// several threads pushing big requests through one rpcc, over one
+// connection and over a pool of them
+struct put_worker {
+	rpcc *c;
+	int len;
+	volatile bool *stop;
+	unsigned long long bytes;
+};
+
+void *
+put_loop(void *x)
+{
+	put_worker *w = (put_worker *) x;
+	std::string arg(w->len, 'p');
+	while(!*w->stop){
+		int r;
+		VERIFY(w->c->call<26>(arg, r) == 0 && r == w->len);
+		w->bytes += w->len;
+	}
+	return 0;
+}
+
+void
+channels_bench()
+{
+	printf("channels_bench\n");
+	struct {
+		const char *name;
+		int n, policy;
+	} sets[] = {
+		{ "1 channel", 1, rpcc::PER_THREAD },
+		{ "4 channels, per thread", 4, rpcc::PER_THREAD },
+		{ "4 channels, least outstanding", 4, rpcc::LEAST_OUTSTANDING },
+	};
+	for(unsigned s = 0; s < sizeof(sets) / sizeof(sets[0]); s++){
+		rpcc c(dst);
+		VERIFY(c.bind() == 0);
+		c.set_channels(sets[s].n, sets[s].policy);
+		const int nt = 4;
+		volatile bool stop = false;
+		put_worker w[nt];
+		pthread_t th[nt];
+		for(int i = 0; i < nt; i++){
+			w[i].c = &c;
+			w[i].len = 256 << 10;
+			w[i].stop = &stop;
+			w[i].bytes = 0;
+			VERIFY(pthread_create(&th[i], NULL, put_loop, &w[i]) == 0);
+		}
+		sleep(2);
+		stop = true;
+		unsigned long long bytes = 0;
+		for(int i = 0; i < nt; i++){
+			VERIFY(pthread_join(th[i], NULL) == 0);
+			bytes += w[i].bytes;
+		}
+		printf("   -- %d threads, %s: %llu MB/s\n", nt, sets[s].name,
+		       bytes / 2 / 1000000);
+	}
+}
+
+// puts of data of a few entropies, without compression and with,
+// and what the codec makes of the data
+void
+compress_bench()
+{
+	printf("compress_bench\n");
+	int pcts[] = { 0, 5, 25, 50, 100 };
+	int len = 256 << 10;
+	for(int k = 0; k < 5; k++){
+		std::string a = entropic(len, pcts[k]);
+		std::vector<char> c(rpc_compress_bound(len));
+		struct timespec start, end;
+		int n = 0, rounds = 50;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int i = 0; i < rounds; i++)
+			n = rpc_compress(a.data(), len, &c[0]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		int cms = diff_timespec(end, start);
+		std::vector<char> d(len);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int i = 0; i < rounds; i++)
+			VERIFY(rpc_decompress(&c[0], n, &d[0], len) == len);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		int dms = diff_timespec(end, start);
+		printf("   -- %3d%% random: ratio %.2f, compress %d MB/s, decompress %d MB/s\n",
+		       pcts[k], (double) len / n, (int) ((long long) len * rounds / 1000 / (cms ? cms : 1)),
+		       (int) ((long long) len * rounds / 1000 / (dms ? dms : 1)));
+		for(int on = 0; on < 2; on++){
+			set_compression(on ? 1024 : 0);
+			rpcc z(dst);
+			VERIFY(z.bind() == 0);
+			int calls = 200, r;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for(int i = 0; i < calls; i++)
+				VERIFY(z.call<26>(a, r) == 0 && r == len);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			printf("         %d KB put, compression %s: %d us/call\n", len >> 10,
+			       on ? "on " : "off", diff_timespec(end, start) * 1000 / calls);
+		}
+		set_compression(0);
+	}
+}
+
+// CRC-32C throughput over buffers of a few sizes, with the crc32
+// instruction (if the CPU has it) and with tables
+void
+crc_bench()
+{
+	printf("crc_bench (crc32 instruction %s)\n",
+	       crc32c_hw() ? "available" : "not available");
+	int sizes[] = { 256, 4096, 1 << 20 };
+	for(int i = 0; i < 3; i++){
+		std::string buf(sizes[i], 'c');
+		for(int hw = 1; hw >= 0; hw--){
+			if(hw && !crc32c_hw())
+				continue;
+			long long total = 256LL << 20;
+			uint32_t c = 0;
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for(long long done = 0; done < total; done += sizes[i])
+				c = hw ? crc32c(c, buf.data(), sizes[i]) :
+				    crc32c_sw(c, buf.data(), sizes[i]);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			int ms = diff_timespec(end, start);
+			printf("   -- %7d byte buffers, %s: %.2f GB/s (%x)\n", sizes[i],
+			       hw ? "crc32 " : "tables", (double) total / (ms ? ms : 1) / 1e6, c);
+		}
+	}
+}
+
+// round trips of a tiny call over loopback TCP and over the server's
+// unix-domain socket
+void
+rtt_bench()
+{
+	printf("rtt_bench\n");
+	char tcp[32];
+	snprintf(tcp, sizeof(tcp), "127.0.0.1:%d", port);
+	std::string dsts[] = { tcp, "unix:" + unix_sock_path(port) };
+	for(int i = 0; i < 2; i++){
+		rpcc c(dsts[i]);
+		VERIFY(c.bind() == 0);
+		int n = 20000, r;
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int k = 0; k < n; k++)
+			VERIFY(c.call<23>(k, r) == 0 && r == k + 1);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf("   -- %s: %.1f us/call\n", i ? "unix" : "tcp ",
+		       diff_timespec(end, start) * 1000.0 / n);
+	}
+}
+
+static long long
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// n tiny calls, depth of them in flight at a time; lat gets the
+// latency (ns) of each
+static void
+latency_run(rpcc *c, int depth, int n, std::vector<long long> &lat)
+{
+	rpcc::future *f[depth];
+	long long sent[depth];
+	for(int i = 0; i < depth; i++){
+		sent[i] = now_ns();
+		f[i] = c->async<23>(i);
+	}
+	for(int k = 0; k < n; k++){
+		int i = k % depth, rep;
+		VERIFY(f[i]->get(rep) == 0 && rep == i + 1);
+		lat.push_back(now_ns() - sent[i]);
+		delete f[i];
+		sent[i] = now_ns();
+		f[i] = c->async<23>(i);
+	}
+	for(int i = 0; i < depth; i++){
+		int rep;
+		VERIFY(f[i]->get(rep) == 0);
+		delete f[i];
+	}
+}
+
+// small-call latency percentiles under several socket option sets,
+// one at a time and pipelined. the options apply to sockets created
+// after set_sockopts, so each set gets a fresh client (and, when the
+// server runs in this process, a fresh server-side socket).
+void
+latency_bench()
+{
+	printf("latency_bench\n");
+	sockopts def = get_sockopts();
+	struct {
+		const char *name;
+		sockopts o;
+	} sets[] = {
+		{ "nodelay", { true, def.sndbuf, def.rcvbuf, def.busy_poll } },
+		{ "nagle", { false, def.sndbuf, def.rcvbuf, def.busy_poll } },
+		{ "nodelay 16k bufs", { true, 16 << 10, 16 << 10, def.busy_poll } },
+		{ "nodelay 1m bufs", { true, 1 << 20, 1 << 20, def.busy_poll } },
+		{ "nodelay busy_poll 50", { true, def.sndbuf, def.rcvbuf, 50 } },
+	};
+	char tcp[32];
+	snprintf(tcp, sizeof(tcp), "127.0.0.1:%d", port);
+	for(unsigned s = 0; s < sizeof(sets) / sizeof(sets[0]); s++){
+		set_sockopts(sets[s].o);
+		rpcc c(tcp);
+		VERIFY(c.bind() == 0);
+		for(int depth = 1; depth <= 8; depth *= 8){
+			std::vector<long long> lat;
+			latency_run(&c, depth, 1000, lat); // warm up
+			lat.clear();
+			latency_run(&c, depth, 20000, lat);
+			std::sort(lat.begin(), lat.end());
+			int n = lat.size();
+			printf("   -- %-21s depth %d: p50 %5.1f p99 %6.1f p999 %6.1f us\n",
+			       sets[s].name, depth, lat[n / 2] / 1000.0,
+			       lat[n * 99 / 100] / 1000.0, lat[n * 999 / 1000] / 1000.0);
+		}
+	}
+	set_sockopts(def);
+}
+
+struct call_worker {
+	rpcc *c;
+	volatile bool *stop;
+	unsigned long long calls;
+};
+
+void *
+call_loop(void *x)
+{
+	call_worker *w = (call_worker *) x;
+	while(!*w->stop){
+		int rep;
+		VERIFY(w->c->call<23>(1, rep) == 0 && rep == 2);
+		w->calls++;
+	}
+	return 0;
+}
+
+// many threads making tiny calls through one client, with send
+// batching off and with a few windows: calls per second, and the
+// writev and read calls per RPC (both ends, when the server runs in
+// this process)
+void
+batch_bench()
+{
+	printf("batch_bench\n");
+	int windows[] = { 0, 20, 50, 200 };
+	for(int k = 0; k < 4; k++){
+		set_batching(windows[k]);
+		rpcc c(dst);
+		VERIFY(c.bind() == 0);
+		const int nt = 16;
+		volatile bool stop = false;
+		call_worker w[nt];
+		pthread_t th[nt];
+		unsigned long long writes = rpc_write_calls;
+		unsigned long long reads = rpc_read_calls;
+		for(int i = 0; i < nt; i++){
+			w[i].c = &c;
+			w[i].stop = &stop;
+			w[i].calls = 0;
+			VERIFY(pthread_create(&th[i], &attr, call_loop, &w[i]) == 0);
+		}
+		sleep(2);
+		stop = true;
+		unsigned long long calls = 0;
+		for(int i = 0; i < nt; i++){
+			VERIFY(pthread_join(th[i], NULL) == 0);
+			calls += w[i].calls;
+		}
+		writes = rpc_write_calls - writes;
+		reads = rpc_read_calls - reads;
+		printf("   -- %d threads, window %3d us: %6llu calls/s, %.2f writev and %.2f reads per call\n",
+		       nt, windows[k], calls / 2, (double) writes / calls,
+		       (double) reads / calls);
+	}
+	set_batching(0);
+}
+
 void
 simple_tests(rpcc *c)
 {
@@ -194,56 +887,156 @@ simple_tests(rpcc *c)
 	// to marshall the RPC call packet, and how to unmarshall
 	// the reply packet.
 	std::string rep;
-	int intret = c->call(22, (std::string)"hello", (std::string)" goodbye", rep);
+	int intret = c->call<22>((std::string)"hello", (std::string)" goodbye", rep);
 	VERIFY(intret == 0); // this is what handle_22 returns
 	VERIFY(rep == "hello goodbye");
 	printf("   -- string concat RPC .. ok\n");
 
+	// a tabled proc: the number argument is converted to the
+	// table's type, synchronously and through a future
+	static_assert(rpc_tabled<22>::value && rpc_tabled<23>::value &&
+	    !rpc_tabled<24>::value, "rpctest's protocol table");
+	{
+		int x = 0;
+		unsigned char small = 41;
+		VERIFY(c->call<23>(small, x) == 0 && x == 42);
+		rpcc::future *f = c->async<23>(short(9));
+		VERIFY(f->get(x) == 0 && x == 10);
+		delete f;
+	}
+	printf("   -- tabled procs .. ok\n");
+
 	// small request, big reply (perhaps req via UDP, reply via TCP)
-	intret = c->call(25, 70000, rep, rpcc::to(200000));
+	intret = c->call<25>(70000, rep, rpcc::to(200000));
 	VERIFY(intret == 0);
 	VERIFY(rep.size() == 70000);
 	printf("   -- small request, big reply .. ok\n");
 
 #if 0
+	// none of these builds: 22 and 23 have protocol tables
 	// too few arguments
-	intret = c->call(22, (std::string)"just one", rep);
+	intret = c->call<22>((std::string)"just one", rep);
 	VERIFY(intret < 0);
 	printf("   -- too few arguments .. failed ok\n");
 
 	// too many arguments; proc #23 expects just one.
-	intret = c->call(23, 1001, 1002, rep);
+	intret = c->call<23>(1001, 1002, rep);
 	VERIFY(intret < 0);
 	printf("   -- too many arguments .. failed ok\n");
 
 	// wrong return value size
 	int wrongrep;
-	intret = c->call(23, (std::string)"hello", (std::string)" goodbye", wrongrep);
+	intret = c->call<23>((std::string)"hello", (std::string)" goodbye", wrongrep);
 	VERIFY(intret < 0);
 	printf("   -- wrong ret value size .. failed ok\n");
 #endif
 
 	// specify a timeout value to an RPC that should succeed (udp)
 	int xx = 0;
-	intret = c->call(23, 77, xx, rpcc::to(3000));
+	intret = c->call<23>(77, xx, rpcc::to(3000));
 	VERIFY(intret == 0 && xx == 78);
 	printf("   -- no suprious timeout .. ok\n");
 
+	// several calls in flight from one thread; the replies
+	// can come back in any order
+	{
+		rpcc::future *f[8];
+		for(int i = 0; i < 8; i++)
+			f[i] = i % 2 ? c->async<23>(i) : c->async<24>(i);
+		for(int i = 7; i >= 0; i--){
+			VERIFY(f[i]->get(xx) == 0);
+			VERIFY(xx == (i % 2 ? i+1 : i+2));
+			delete f[i];
+		}
+		printf("   -- pipelined async calls .. ok\n");
+	}
+
+	// more calls in flight than a client's reply window starts with,
+	// and replies too big for the socket to take at once. the server
+	// keeps no more of them than its reply budget.
+	{
+		if(server)
+			server->set_reply_budget(200000);
+		rpcc::future *f[100];
+		for(int i = 0; i < 100; i++)
+			f[i] = c->async<25>(20000 + i);
+		for(int i = 0; i < 100; i++){
+			VERIFY(f[i]->get(rep) == 0 && (int)rep.size() == 20000 + i);
+			delete f[i];
+		}
+		if(server){
+			VERIFY(server->reply_bytes() <= 200000);
+			VERIFY(server->evictions() > 0);
+			server->set_reply_budget(rpcs::DEFAULT_REPLY_BUDGET);
+		}
+		printf("   -- many big replies in flight .. ok\n");
+	}
+
+	// more blocked handlers than the dispatch pool has threads;
+	// they run on their own pool, so other procs still get through
+	{
+		rpcc::future *f[rpcs::DISPATCH_MAX_THREADS + 1];
+		int nf = sizeof(f) / sizeof(f[0]);
+		c->call<29>(0, xx);
+		for(int i = 0; i < nf; i++)
+			f[i] = c->async<28>(i);
+		intret = c->call<23>(5, xx, rpcc::to(3000));
+		VERIFY(intret == 0 && xx == 6);
+		VERIFY(c->call<29>(1, xx) == 0);
+		for(int i = 0; i < nf; i++){
+			VERIFY(f[i]->get(xx) == 0 && xx == i);
+			delete f[i];
+		}
+		printf("   -- blocking procs on their own pool .. ok\n");
+	}
+
+	// many calls waiting on their timers at once; each gives up
+	// at its own deadline, on the monotonic clock
+	{
+		rpcc::future *f[20];
+		c->call<29>(0, xx);
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int i = 0; i < 20; i++)
+			f[i] = c->async<28>(i, rpcc::to(1000 + 50 * i));
+		for(int i = 0; i < 20; i++){
+			VERIFY(f[i]->wait() == rpc_const::timeout_failure);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			VERIFY(diff_timespec(end, start) >= 1000 + 50 * i);
+			delete f[i];
+		}
+		VERIFY(diff_timespec(end, start) < 3000);
+		VERIFY(c->call<29>(1, xx) == 0);
+		printf("   -- many timeouts at once .. ok\n");
+	}
+
 	// specify a timeout value to an RPC that should succeed (tcp)
 	{
 		std::string arg(1000, 'x');
 		std::string rep;
-		c->call(22, arg, (std::string)"x", rep, rpcc::to(3000));
+		c->call<22>(arg, (std::string)"x", rep, rpcc::to(3000));
 		VERIFY(rep.size() == 1001);
 		printf("   -- no suprious timeout .. ok\n");
 	}
 
 	// huge RPC
 	std::string big(1000000, 'x');
-	intret = c->call(22, big, (std::string)"z", rep);
+	intret = c->call<22>(big, (std::string)"z", rep);
 	VERIFY(rep.size() == 1000001);
 	printf("   -- huge 1M rpc request .. ok\n");
 
+	// an async call must not depend on its (borrowed) arguments
+	// outliving async()
+	{
+		rpcc::future *f = c->async<22>(std::string(100000, 'y'),
+					   (std::string)"z");
+		std::string junk(100000, 'j');
+		VERIFY(f->get(rep) == 0);
+		VERIFY(rep == std::string(100000, 'y') + "z");
+		delete f;
+		printf("   -- big async request .. ok\n");
+	}
+
 	// specify a timeout value to an RPC that should timeout (udp)
 	struct sockaddr_in non_existent;
 	memset(&non_existent, 0, sizeof(non_existent));
@@ -256,6 +1049,57 @@ simple_tests(rpcc *c)
 	time_t t1 = time(0);
 	VERIFY(intret < 0 && (t1 - t0) <= 4);
 	printf("   -- rpc timeout .. ok\n");
+
+	// the server also listens on a unix-domain socket, in the
+	// directory main puts in $RPC_UNIX_DIR
+	if(server){
+		rpcc *u = new rpcc("unix:" + unix_sock_path(port));
+		VERIFY(u->bind() == 0);
+		intret = u->call<22>((std::string)"hello", (std::string)" goodbye", rep);
+		VERIFY(intret == 0 && rep == "hello goodbye");
+		intret = u->call<25>(70000, rep);
+		VERIFY(intret == 0 && rep.size() == 70000);
+		delete u;
+		u = new rpcc("unix:/tmp/rpc.no.such.sock");
+		VERIFY(u->bind(rpcc::to(1000)) < 0);
+		delete u;
+
+		// a server whose socket path is taken by something else
+		// keeps serving TCP, and leaves that alone
+		std::string taken = unix_sock_path(port + 1);
+		FILE *f = fopen(taken.c_str(), "w");
+		VERIFY(f != NULL);
+		fclose(f);
+		rpcs *s2 = new rpcs(port + 1);
+		struct sockaddr_in d2 = dst;
+		d2.sin_port = htons(port + 1);
+		u = new rpcc(d2);
+		VERIFY(u->bind() == 0);
+		delete u;
+		delete s2;
+		struct stat st;
+		VERIFY(lstat(taken.c_str(), &st) == 0 && S_ISREG(st.st_mode));
+		unlink(taken.c_str());
+	}
+	printf("   -- calls over a unix-domain socket .. ok\n");
+
+	// with compression on, big compressible requests and replies
+	// are squeezed, and others go out as they are
+	if(server){
+		set_compression(1024);
+		rpcc *z = new rpcc(dst);
+		VERIFY(z->bind() == 0);
+		for(int pct = 0; pct <= 100; pct += 50){
+			std::string a = entropic(100000, pct);
+			intret = z->call<22>(a, (std::string)"!", rep);
+			VERIFY(intret == 0 && rep == a + "!");
+			intret = z->call<25>(300000, rep);
+			VERIFY(intret == 0 && rep == std::string(300000, 'x'));
+		}
+		delete z;
+		set_compression(0);
+		printf("   -- compressed calls .. ok\n");
+	}
 	printf("simple_tests OK\n");
 }
 
@@ -292,6 +1136,9 @@ lossy_test()
 	if (server) {
 		delete server;
 		startserver();
+		// room for a reply or two: most retransmitted calls to the
+		// idempotent proc 25 find their reply evicted and run again
+		server->set_reply_budget(4000);
 	}
 
 	for (int i = 0; i < NUM_CL; i++) {
@@ -299,6 +1146,9 @@ lossy_test()
 		clients[i] = new rpcc(dst);
 		VERIFY(clients[i]->bind()==0);
 	}
+	// lost connections are replaced slot by slot, and retransmissions
+	// may come in on another slot's connection than the first try
+	clients[0]->set_channels(3, rpcc::LEAST_OUTSTANDING);
 
 	int nt = 1;
 	pthread_t th[nt];
@@ -332,7 +1182,7 @@ failure_test()
 	startserver();
 
 	std::string rep;
-	int intret = client->call(22, (std::string)"hello", (std::string)" goodbye", rep);
+	int intret = client->call<22>((std::string)"hello", (std::string)" goodbye", rep);
 	VERIFY(intret == rpc_const::oldsrv_failure);
 	printf("   -- call recovered server with old client .. failed ok\n");
 
@@ -342,7 +1192,7 @@ failure_test()
 	VERIFY (client->bind() >= 0);
 	VERIFY (client->bind() < 0);
 
-	intret = client->call(22, (std::string)"hello", (std::string)" goodbye", rep);
+	intret = client->call<22>((std::string)"hello", (std::string)" goodbye", rep);
 	VERIFY(intret == 0);
 	VERIFY(rep == "hello goodbye");
 
@@ -386,6 +1236,13 @@ failure_test()
 	printf("failure_test OK\n");
 }
 
+static void
+remove_unix_dir()
+{
+	unlink(unix_sock_path(port).c_str());
+	rmdir(getenv("RPC_UNIX_DIR"));
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -396,12 +1253,13 @@ main(int argc, char *argv[])
 
 	bool isclient = false;
 	bool isserver = false;
+	const char *bench = NULL;
 
 	srandom(getpid());
 	port = 20000 + (getpid() % 10000);
 
 	char ch = 0;
-	while ((ch = getopt(argc, argv, "csd:p:l"))!=-1) {
+	while ((ch = getopt(argc, argv, "csd:p:lb:"))!=-1) {
 		switch (ch) {
 			case 'c':
 				isclient = true;
@@ -415,6 +1273,9 @@ main(int argc, char *argv[])
 			case 'p':
 				port = atoi(optarg);
 				break;
+			case 'b':
+				bench = optarg;
+				break;
 			case 'l':
 				VERIFY(setenv("RPC_LOSSY", "5", 1) == 0);
 			default:
@@ -432,7 +1293,18 @@ main(int argc, char *argv[])
 		jsl_log(JSL_DBG_1, "DEBUG LEVEL: %d\n", debug_level);
 	}
 
+	// a private directory for the server's unix-domain socket,
+	// removed at exit
+	if (getenv("RPC_UNIX_DIR") == NULL) {
+		static char udir[] = "/tmp/rpctest.XXXXXX";
+		VERIFY(mkdtemp(udir) != NULL);
+		VERIFY(setenv("RPC_UNIX_DIR", udir, 1) == 0);
+		atexit(remove_unix_dir);
+	}
+
 	testmarshall();
+	testchecksum();
+	testcompress();
 
 	pthread_attr_init(&attr);
 	// set stack size to 32K, so we don't run out of memory
@@ -461,8 +1333,44 @@ main(int argc, char *argv[])
 			VERIFY (clients[i]->bind() == 0);
 		}
 
+		if (bench) {
+			if (strcmp(bench, "pipeline") == 0)
+				pipeline_bench(clients[0]);
+			else if (strcmp(bench, "put") == 0)
+				put_bench(clients[0]);
+			else if (strcmp(bench, "get") == 0)
+				get_bench(clients[0]);
+			else if (strcmp(bench, "pool") == 0)
+				pool_bench();
+			else if (strcmp(bench, "compress") == 0)
+				compress_bench();
+			else if (strcmp(bench, "crc") == 0)
+				crc_bench();
+			else if (strcmp(bench, "channels") == 0)
+				channels_bench();
+			else if (strcmp(bench, "latency") == 0)
+				latency_bench();
+			else if (strcmp(bench, "batch") == 0)
+				batch_bench();
+			else if (strcmp(bench, "rtt") == 0)
+				rtt_bench();
+			else if (strcmp(bench, "conns") == 0)
+				conns_bench(10000, isserver);
+			else
+				fprintf(stderr, "unknown benchmark %s\n", bench);
+			exit(0);
+		}
+
 		simple_tests(clients[0]);
 		concurrent_test(10);
+		// the same over several connections per client
+		clients[0]->set_channels(4, rpcc::PER_THREAD);
+		clients[1]->set_channels(4, rpcc::LEAST_OUTSTANDING);
+		concurrent_test(10);
+		// and with small PDUs sent in batches
+		set_batching(50);
+		concurrent_test(10);
+		set_batching(0);
 		lossy_test();
 		if (isserver) {
 			failure_test();
@@ -1,19 +1,37 @@
 #include "slock.h"
 #include "thr_pool.h"
+#include "futex.h"
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include "gettime.h"
 #include "lang/verify.h"
 
-static void *
-do_worker(void *arg)
+#ifndef __linux__
+pthread_mutex_t futex_emul_m = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t futex_emul_c = PTHREAD_COND_INITIALIZER;
+#endif
+
+static unsigned long long
+now_us()
 {
-	ThrPool *tp = (ThrPool *)arg;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void *
+ThrPool::worker(void *arg)
+{
+	lane_t *me = (lane_t *)arg;
+	ThrPool *tp = me->tp;
 	while (1) {
 		ThrPool::job_t j;
-		if (!tp->takeJob(&j))
+		if (!tp->takeJob(me, &j))
 			break; //die
 
-		(void)(j.f)(j.a);
+		(j.f)(&j);
 	}
 	pthread_exit(NULL);
 }
@@ -21,49 +39,389 @@ do_worker(void *arg)
 //if blocking, then addJob() blocks when queue is full
 //otherwise, addJob() simply returns false when queue is full
 ThrPool::ThrPool(int sz, bool blocking)
-: nthreads_(sz),blockadd_(blocking),jobq_(100*sz) 
+: minthreads_(sz),maxthreads_(sz)
+{
+	init(blocking);
+}
+
+ThrPool::ThrPool(int minsz, int maxsz, bool blocking)
+: minthreads_(minsz),maxthreads_(maxsz)
+{
+	init(blocking);
+}
+
+void
+ThrPool::init(bool blocking)
 {
+	VERIFY(minthreads_ > 0 && minthreads_ <= maxthreads_);
+	nthreads_ = nlanes_ = 0;
+	blockadd_ = blocking;
+	stopping_ = false;
+	sampled_ = wait_us_ = stolen_ = 0;
+	idle_ = 0;
+	space_ev_ = space_sleepers_ = 0;
+	VERIFY(pthread_mutex_init(&grow_m_, NULL) == 0);
+
+	//room for 100 jobs per thread, rounded up to a power of two
+	unsigned int cap = 1;
+	while (cap < (unsigned int)(100*maxthreads_))
+		cap <<= 1;
+	shared_.init(cap);
+	lanes_ = new lane_t[maxthreads_];
+	for (int i = 0; i < maxthreads_; i++) {
+		lanes_[i].tp = this;
+		lanes_[i].q.init(LANE_SZ);
+		lanes_[i].ev = lanes_[i].sleeping = 0;
+		lanes_[i].busy = lanes_[i].live = 0;
+	}
+
 	pthread_attr_init(&attr_);
 	pthread_attr_setstacksize(&attr_, 128<<10);
 
-	for (int i = 0; i < sz; i++) {
-		pthread_t t;
-		VERIFY(pthread_create(&t, &attr_, do_worker, (void *)this) ==0);
-		th_.push_back(t);
-	}
+	ScopedLock gl(&grow_m_);
+	for (int i = 0; i < minthreads_; i++)
+		VERIFY(spawn());
 }
 
-//IMPORTANT: this function can be called only when no external thread 
+//IMPORTANT: this function can be called only when no external thread
 //will ever use this thread pool again or is currently blocking on it
 ThrPool::~ThrPool()
 {
-	for (int i = 0; i < nthreads_; i++) {
+	int n;
+	{
+		ScopedLock gl(&grow_m_);
+		stopping_ = true; //no more workers come or go
+		n = nthreads_;
+	}
+
+	//workers look at their own lane before the shared ring, so
+	//each one finishes its lane before it takes a pill
+	for (int i = 0; i < n; i++) {
 		job_t j;
-		j.f = (void *(*)(void *))NULL; //poison pill to tell worker threads to exit
-		jobq_.enq(j);
+		j.f = NULL; //poison pill to tell worker threads to exit
+		bool saved = blockadd_;
+		blockadd_ = true;
+		VERIFY(addJob(j, NO_HINT));
+		blockadd_ = saved;
 	}
 
-	for (int i = 0; i < nthreads_; i++) {
-		VERIFY(pthread_join(th_[i], NULL)==0);
+	std::list<pthread_t>::iterator it;
+	for (it = th_.begin(); it != th_.end(); it++) {
+		VERIFY(pthread_join(*it, NULL)==0);
 	}
+	reap();
 
 	VERIFY(pthread_attr_destroy(&attr_)==0);
+	VERIFY(pthread_mutex_destroy(&grow_m_)==0);
+	delete [] lanes_;
+}
+
+//join workers that have exited; grow_m_ must be held
+void
+ThrPool::reap()
+{
+	while (!zombies_.empty()) {
+		VERIFY(pthread_join(zombies_.front(), NULL)==0);
+		zombies_.pop_front();
+	}
+}
+
+//start a worker on the first lane without one; grow_m_ must be held
+bool
+ThrPool::spawn()
+{
+	lane_t *l = &lanes_[nthreads_];
+	__atomic_store_n(&l->busy, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&l->sleeping, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&l->live, 1, __ATOMIC_SEQ_CST);
+	pthread_t t;
+	if (pthread_create(&t, &attr_, &ThrPool::worker, (void *)l) != 0) {
+		__atomic_store_n(&l->live, 0, __ATOMIC_SEQ_CST);
+		return false;
+	}
+	th_.push_back(t);
+	__atomic_add_fetch(&nthreads_, 1, __ATOMIC_SEQ_CST);
+	if (nthreads_ > nlanes_)
+		__atomic_store_n(&nlanes_, nthreads_, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+//start one more worker. addJob calls this on the caller's thread, so
+//it gives up rather than wait if another add is already growing.
+void
+ThrPool::grow()
+{
+	if (pthread_mutex_trylock(&grow_m_) != 0)
+		return;
+	reap();
+	if (!stopping_ && nthreads_ < maxthreads_)
+		spawn();
+	VERIFY(pthread_mutex_unlock(&grow_m_)==0);
+}
+
+//called by an idle worker; true if it should exit. only the worker
+//on the last lane retires, so the live lanes stay 0..nthreads_-1.
+bool
+ThrPool::retire(lane_t *me)
+{
+	ScopedLock gl(&grow_m_);
+	if (stopping_ || me - lanes_ != nthreads_ - 1 ||
+	    nthreads_ <= minthreads_)
+		return false;
+	//an add that still picked this lane either sees live go to 0
+	//and finds another worker for its job, or we see the job here
+	__atomic_store_n(&me->live, 0, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (me->q.depth() > 0) {
+		__atomic_store_n(&me->live, 1, __ATOMIC_SEQ_CST);
+		return false;
+	}
+	__atomic_sub_fetch(&nthreads_, 1, __ATOMIC_SEQ_CST);
+	pthread_t self = pthread_self();
+	std::list<pthread_t>::iterator it;
+	for (it = th_.begin(); it != th_.end(); it++) {
+		if (pthread_equal(*it, self)) {
+			th_.erase(it);
+			break;
+		}
+	}
+	zombies_.push_back(self);
+	return true;
+}
+
+unsigned int
+ThrPool::depth()
+{
+	unsigned int d = shared_.depth();
+	int n = __atomic_load_n(&nlanes_, __ATOMIC_RELAXED);
+	for (int i = 0; i < n; i++)
+		d += lanes_[i].q.depth();
+	return d;
+}
+
+unsigned long long
+ThrPool::avg_wait_us()
+{
+	unsigned long long n = __atomic_load_n(&sampled_, __ATOMIC_RELAXED);
+	return n ? __atomic_load_n(&wait_us_, __ATOMIC_RELAXED) / n : 0;
+}
+
+void
+ThrPool::ring::init(unsigned int cap)
+{
+	VERIFY(cap > 0 && (cap & (cap - 1)) == 0);
+	cells_ = new cell_t[cap];
+	mask_ = cap - 1;
+	for (unsigned int i = 0; i < cap; i++)
+		cells_[i].seq = i;
+	enq_pos_ = deq_pos_ = 0;
+}
+
+//claim the cell at enq_pos_ if its sequence says it is free on this lap
+bool
+ThrPool::ring::enq(const job_t &j)
+{
+	unsigned int pos = __atomic_load_n(&enq_pos_, __ATOMIC_RELAXED);
+	cell_t *c;
+	while (1) {
+		c = &cells_[pos & mask_];
+		unsigned int seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		int dif = (int)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&enq_pos_, &pos, pos + 1, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return false; //full
+		} else {
+			pos = __atomic_load_n(&enq_pos_, __ATOMIC_RELAXED);
+		}
+	}
+	c->job = j;
+	//reading the clock costs about as much as the rest of an add
+	c->stamp = (pos % WAIT_SAMPLE) == 0 ? now_us() : 0;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+bool
+ThrPool::ring::deq(job_t *j, unsigned long long *stamp)
+{
+	unsigned int pos = __atomic_load_n(&deq_pos_, __ATOMIC_RELAXED);
+	cell_t *c;
+	while (1) {
+		c = &cells_[pos & mask_];
+		unsigned int seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		int dif = (int)(seq - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&deq_pos_, &pos, pos + 1, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return false; //empty
+		} else {
+			pos = __atomic_load_n(&deq_pos_, __ATOMIC_RELAXED);
+		}
+	}
+	*j = c->job;
+	*stamp = c->stamp;
+	__atomic_store_n(&c->seq, pos + mask_ + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+unsigned int
+ThrPool::ring::depth()
+{
+	int d = (int)(__atomic_load_n(&enq_pos_, __ATOMIC_RELAXED) -
+		      __atomic_load_n(&deq_pos_, __ATOMIC_RELAXED));
+	return d > 0 ? d : 0;
 }
 
-bool 
-ThrPool::addJob(void *(*f)(void *), void *a)
+//wake l's worker if it sleeps; whoever clears sleeping does the wake
+bool
+ThrPool::wake(lane_t *l)
 {
-	job_t j;
-	j.f = f;
-	j.a = a;
+	int one = 1;
+	if (!__atomic_compare_exchange_n(&l->sleeping, &one, 0, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return false;
+	__atomic_sub_fetch(&idle_, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&l->ev, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&l->ev, 1);
+	return true;
+}
+
+//wake some idle worker, looking at the lanes after from first
+bool
+ThrPool::wake_any(int from)
+{
+	if (__atomic_load_n(&idle_, __ATOMIC_SEQ_CST) == 0)
+		return false;
+	int n = __atomic_load_n(&nlanes_, __ATOMIC_SEQ_CST);
+	for (int i = 1; i <= n; i++) {
+		lane_t *l = &lanes_[(from + i + n) % n];
+		if (__atomic_load_n(&l->sleeping, __ATOMIC_SEQ_CST) && wake(l))
+			return true;
+	}
+	return false;
+}
+
+//the idle and sleeping flags are set before a worker's last look at
+//the queues and read by adders after a full fence, so either the
+//adder sees the sleeper or the sleeper sees the job; bumping the
+//futex word also makes a futex_wait that has not started yet return
+//at once.
+bool
+ThrPool::addJob(const job_t &j, int hint)
+{
+	lane_t *l = NULL;
+	if (hint >= 0) {
+		l = &lanes_[hint % __atomic_load_n(&nthreads_, __ATOMIC_RELAXED)];
+		if (!l->q.enq(j))
+			l = NULL; //its owner is behind; spill to the shared ring
+	}
+	while (!l && !shared_.enq(j)) {
+		if (!blockadd_)
+			return false;
+		int ev = __atomic_load_n(&space_ev_, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&space_sleepers_, 1, __ATOMIC_SEQ_CST);
+		if (shared_.enq(j)) {
+			__atomic_sub_fetch(&space_sleepers_, 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+		futex_wait(&space_ev_, ev);
+		__atomic_sub_fetch(&space_sleepers_, 1, __ATOMIC_SEQ_CST);
+	}
 
-	return jobq_.enq(j,blockadd_);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (l) {
+		if (wake(l))
+			return true;
+		//the owner is between jobs and looks at its lane next
+		if (__atomic_load_n(&l->live, __ATOMIC_SEQ_CST) &&
+		    !__atomic_load_n(&l->busy, __ATOMIC_SEQ_CST))
+			return true;
+	}
+	//the owner is busy or gone, or the job is for anyone
+	if (wake_any(l ? (int)(l - lanes_) : -1))
+		return true;
+	//every worker is busy
+	if (j.f != NULL &&
+	    __atomic_load_n(&nthreads_, __ATOMIC_RELAXED) < maxthreads_ &&
+	    (l ? l->q.depth() : shared_.depth()) > 0)
+		grow();
+	return true;
 }
 
-bool 
-ThrPool::takeJob(job_t *j)
+//the next job for me: my lane, then the shared ring, then other lanes
+bool
+ThrPool::find(lane_t *me, job_t *j, unsigned long long *stamp)
 {
-	jobq_.deq(j);
-	return (j->f!=NULL);
+	if (me->q.deq(j, stamp))
+		return true;
+	if (shared_.deq(j, stamp)) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&space_sleepers_, __ATOMIC_SEQ_CST) > 0) {
+			__atomic_add_fetch(&space_ev_, 1, __ATOMIC_SEQ_CST);
+			futex_wake(&space_ev_, INT_MAX);
+		}
+		return true;
+	}
+	int n = __atomic_load_n(&nlanes_, __ATOMIC_ACQUIRE);
+	int self = me - lanes_;
+	for (int i = 1; i < n; i++) {
+		if (lanes_[(self + i) % n].q.deq(j, stamp)) {
+			__atomic_add_fetch(&stolen_, 1, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+	return false;
 }
 
+bool
+ThrPool::takeJob(lane_t *me, job_t *j)
+{
+	unsigned long long stamp;
+	bool idle = false;
+	__atomic_store_n(&me->busy, 0, __ATOMIC_SEQ_CST);
+	while (!find(me, j, &stamp)) {
+		//nothing came for a whole timeout
+		if (idle && retire(me)) {
+			j->f = NULL;
+			return false;
+		}
+		int ev = __atomic_load_n(&me->ev, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&me->sleeping, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&idle_, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		bool found = find(me, j, &stamp);
+		if (!found) {
+			//only workers above the minimum wait with a timeout
+			int ms = me - lanes_ >= minthreads_ ? IDLE_EXIT_MS : -1;
+			idle = !futex_wait(&me->ev, ev, ms);
+		}
+		int one = 1;
+		if (__atomic_compare_exchange_n(&me->sleeping, &one, 0, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			__atomic_sub_fetch(&idle_, 1, __ATOMIC_SEQ_CST);
+		else
+			idle = false; //an add woke us for a job
+		if (found)
+			break;
+	}
+
+	//jobs queued behind this one on my lane would wait for it;
+	//hand them to an idle worker
+	__atomic_store_n(&me->busy, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (me->q.depth() > 0)
+		wake_any(me - lanes_);
+
+	if (j->f == NULL)
+		return false;
+	if (stamp) {
+		__atomic_add_fetch(&sampled_, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&wait_us_, now_us() - stamp, __ATOMIC_RELAXED);
+	}
+	return true;
+}
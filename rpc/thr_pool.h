@@ -2,65 +2,173 @@
 #define __THR_POOL__
 
 #include <pthread.h>
-#include <vector>
-
-#include "fifo.h"
-
+#include <list>
+#include <new>
+
+#include "lang/verify.h"
+
+// A set of worker threads running jobs from bounded queues.
+//
+// The queues are lock-free multi-producer/multi-consumer rings (after
+// Dmitry Vyukov's): each cell carries a sequence number that tells
+// producers and consumers whether it is free or full for their lap,
+// so adding and taking a job is a CAS on a position counter plus a
+// copy. Jobs are stored by value.
+//
+// Every worker owns a small ring, its lane. A job added with an
+// affinity hint (rpcs uses the connection) goes to the lane of worker
+// hint % threads(), so the jobs of one connection keep running on the
+// same thread; jobs without a hint, or whose lane is full, go to a
+// shared ring. A worker takes from its own lane first, then from the
+// shared ring, and when both are empty it steals from the other
+// lanes. An idle worker sleeps on a futex of its own; an add wakes the
+// lane's owner if it sleeps, and some other idle worker to steal the
+// job if the owner is busy.
+//
+// The pool keeps at least minsz workers. When a job is added and no
+// worker is idle it starts another one, up to maxsz; the newest worker
+// exits again once it has been idle for IDLE_EXIT_MS.
 class ThrPool {
 
 
 	public:
 		struct job_t {
-			void *(*f)(void *); //function point
-			void *a; //function arguments
+			void (*f)(job_t *); //NULL tells a worker to exit
+			void *arg[6];       //the job's own data, see addObjJob
+		};
+
+		enum {
+			IDLE_EXIT_MS = 2000,
+			WAIT_SAMPLE = 64,
+			LANE_SZ = 64,
+			NO_HINT = -1,
 		};
 
 		ThrPool(int sz, bool blocking=true);
+		ThrPool(int minsz, int maxsz, bool blocking);
 		~ThrPool();
-		template<class C, class A> bool addObjJob(C *o, void (C::*m)(A), A a);
+		// o, m and a are copied bytewise into the queue, so A
+		// must be plain data (in practice, a pointer). jobs with
+		// the same (non-negative) hint prefer the same worker.
+		template<class C, class A> bool addObjJob(C *o, void (C::*m)(A), A a,
+				int hint=NO_HINT);
 		void waitDone();
 
-		bool takeJob(job_t *j);
+		// workers running now, and jobs queued but not yet taken
+		int threads() { return __atomic_load_n(&nthreads_, __ATOMIC_RELAXED); }
+		unsigned int depth();
+		// average time (us) a job sits queued, over a sample of
+		// 1 in WAIT_SAMPLE jobs since the pool started
+		unsigned long long avg_wait_us();
+		// jobs that ran on a worker other than the one they were
+		// added for
+		unsigned long long stolen() { return __atomic_load_n(&stolen_, __ATOMIC_RELAXED); }
 
 	private:
-		pthread_attr_t attr_;
-		int nthreads_;
-		bool blockadd_;
+		struct cell_t {
+			unsigned int seq;
+			unsigned long long stamp; //when (us) the job was added, if sampled
+			job_t job;
+		};
 
+		class ring {
+			public:
+				void init(unsigned int cap);
+				~ring() { delete [] cells_; }
+				bool enq(const job_t &j);
+				bool deq(job_t *j, unsigned long long *stamp);
+				unsigned int depth();
+			private:
+				cell_t *cells_;
+				unsigned int mask_;
+				// positions get their own cache lines; producers
+				// and consumers hammer them from different threads
+				char pad0_[64];
+				unsigned int enq_pos_;
+				char pad1_[64];
+				unsigned int deq_pos_;
+				char pad2_[64];
+		};
+
+		// a worker's slot. live says a worker owns it; busy that
+		// the worker is running a job; sleeping that it is parked
+		// on ev, and is cleared by whoever wakes it.
+		struct lane_t {
+			ThrPool *tp;
+			ring q;
+			int ev;
+			int sleeping;
+			int busy;
+			int live;
+			char pad_[64];
+		};
 
-		fifo<job_t> jobq_;
-		std::vector<pthread_t> th_;
+		pthread_attr_t attr_;
+		int minthreads_;
+		int maxthreads_;
+		int nthreads_;  // workers own lanes 0..nthreads_-1
+		int nlanes_;    // lanes ever owned; thieves look at these
+		bool blockadd_;
 
-		bool addJob(void *(*f)(void *), void *a);
+		// grow_m_ protects th_, zombies_ and stopping_, and is held
+		// while nthreads_ changes. workers that exit move their own
+		// thread from th_ to zombies_, to be joined by the next grow
+		// or the destructor.
+		pthread_mutex_t grow_m_;
+		std::list<pthread_t> th_;
+		std::list<pthread_t> zombies_;
+		bool stopping_;
+
+		unsigned long long sampled_;
+		unsigned long long wait_us_;
+		unsigned long long stolen_;
+
+		lane_t *lanes_;
+		ring shared_;
+
+		// parking. idle_ counts workers sleeping on their lane's ev.
+		// space_ev_ is bumped when a job leaves the shared ring, for
+		// blocking adds waiting for room in it.
+		int idle_;
+		int space_ev_;
+		int space_sleepers_;
+
+		static void *worker(void *arg);
+		void init(bool blocking);
+		bool spawn();
+		void grow();
+		bool retire(lane_t *me);
+		void reap();
+		bool find(lane_t *me, job_t *j, unsigned long long *stamp);
+		bool wake(lane_t *l);
+		bool wake_any(int from);
+		bool takeJob(lane_t *me, job_t *j);
+		bool addJob(const job_t &j, int hint);
 };
 
-	template <class C, class A> bool 
-ThrPool::addObjJob(C *o, void (C::*m)(A), A a)
+	template <class C, class A> bool
+ThrPool::addObjJob(C *o, void (C::*m)(A), A a, int hint)
 {
 
-	class objfunc_wrapper {
-		public:
+	struct objfunc_wrapper {
 			C *o;
 			void (C::*m)(A a);
 			A a;
-			static void *func(void *vvv) {
-				objfunc_wrapper *x = (objfunc_wrapper*)vvv;
-				C *o = x->o;
-				void (C::*m)(A ) = x->m;
-				A a = x->a;
-				(o->*m)(a);
-				delete x;
-				return 0;
+			static void func(job_t *j) {
+				objfunc_wrapper *x = (objfunc_wrapper*)j->arg;
+				(x->o->*(x->m))(x->a);
 			}
 	};
 
-	objfunc_wrapper *x = new objfunc_wrapper;
+	job_t j;
+	VERIFY(sizeof(objfunc_wrapper) <= sizeof(j.arg));
+	objfunc_wrapper *x = (objfunc_wrapper *)j.arg;
 	x->o = o;
 	x->m = m;
 	x->a = a;
-	return addJob(&objfunc_wrapper::func, (void *)x);
+	j.f = &objfunc_wrapper::func;
+	return addJob(j, hint);
 }
 
 
 #endif
-
@@ -19,6 +19,11 @@ LOCK_PORT=$[BASE_PORT+6]
 YFSDIR1=$PWD/yfs1
 YFSDIR2=$PWD/yfs2
 
+# the servers also listen on unix-domain sockets in a directory of
+# our own; stop.sh removes it
+export RPC_UNIX_DIR=`mktemp -d` || exit 1
+echo $RPC_UNIX_DIR > rpc_unix_dir
+
 if [ "$LOSSY" ]; then
     export RPC_LOSSY=$LOSSY
 fi
@@ -31,15 +36,20 @@ if [ $NUM_LS -gt 1 ]; then
       x=$[x+1]
       echo $port >> config
     done
+    # each lock_server owns a shard of the lock ids; yfs_client
+    # gets the whole list and hashes every lock to its shard
+    LOCK_DST=
     x=0
     while [ $x -lt $NUM_LS ]; do
       port=$[LOCK_PORT+2*x]
       x=$[x+1]
-      echo "starting ./lock_server $LOCK_PORT $port > lock_server$x.log 2>&1 &"
-      ./lock_server $LOCK_PORT $port > lock_server$x.log 2>&1 &
-      sleep 1
+      LOCK_DST=$LOCK_DST${LOCK_DST:+,}unix:$RPC_UNIX_DIR/rpc.$port.sock
+      echo "starting ./lock_server $port > lock_server$x.log 2>&1 &"
+      ./lock_server $port > lock_server$x.log 2>&1 &
     done
+    sleep 1
 else
+    LOCK_DST=unix:$RPC_UNIX_DIR/rpc.$LOCK_PORT.sock
     echo "starting ./lock_server $LOCK_PORT > lock_server.log 2>&1 &"
     ./lock_server $LOCK_PORT > lock_server.log 2>&1 &
     sleep 1
@@ -47,6 +57,10 @@ fi
 
 unset RPC_LOSSY
 
+# everything runs on this host, so the clients talk to the servers
+# over the servers' unix-domain sockets
+EXTENT_DST=unix:$RPC_UNIX_DIR/rpc.$EXTENT_PORT.sock
+
 echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
 ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
 sleep 1
@@ -54,15 +68,15 @@ sleep 1
 rm -rf $YFSDIR1
 mkdir $YFSDIR1 || exit 1
 sleep 1
-echo "starting ./yfs_client $YFSDIR1 $EXTENT_PORT $LOCK_PORT > yfs_client1.log 2>&1 &"
-./yfs_client $YFSDIR1 $EXTENT_PORT $LOCK_PORT > yfs_client1.log 2>&1 &
+echo "starting ./yfs_client $YFSDIR1 $EXTENT_DST $LOCK_DST > yfs_client1.log 2>&1 &"
+./yfs_client $YFSDIR1 $EXTENT_DST $LOCK_DST > yfs_client1.log 2>&1 &
 sleep 1
 
 rm -rf $YFSDIR2
 mkdir $YFSDIR2 || exit 1
 sleep 1
-echo "starting ./yfs_client $YFSDIR2 $EXTENT_PORT $LOCK_PORT > yfs_client2.log 2>&1 &"
-./yfs_client $YFSDIR2 $EXTENT_PORT $LOCK_PORT > yfs_client2.log 2>&1 &
+echo "starting ./yfs_client $YFSDIR2 $EXTENT_DST $LOCK_DST > yfs_client2.log 2>&1 &"
+./yfs_client $YFSDIR2 $EXTENT_DST $LOCK_DST > yfs_client2.log 2>&1 &
 
 sleep 2
 
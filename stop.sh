@@ -13,3 +13,8 @@ $UMOUNT $YFSDIR2
 killall extent_server
 killall yfs_client
 killall lock_server
+
+if [ -f rpc_unix_dir ]; then
+    rm -rf `cat rpc_unix_dir`
+    rm -f rpc_unix_dir
+fi
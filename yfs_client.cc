@@ -145,7 +145,7 @@ yfs_client::setattr(inum ino, size_t size)
 }
 
 int
-yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out,
+yfs_client::create(inum parent, const char *name, mode_t, inum &ino_out,
                    extent_protocol::types type)
 {
     int r = OK;